@@ -33,6 +33,8 @@ To include the implementation, define `ARENA_ALLOCATOR_IMPLEMENTATION` **in exac
         2. Allocate Memory: Use arena_alloc to allocate memory
             int *numbers = (int*)arena_alloc(&my_arena, 10 * sizeof(int));
             char *string = (char*)arena_alloc(&my_arena, 100 * sizeof(char));
+            float *simd = (float*)arena_alloc_aligned(&my_arena, 64 * sizeof(float), 32);
+            int *counts = arena_new_array(&my_arena, int, 10);   // typed and overflow-checked
 
         3. (Optional) Inspect Arena: Use arena_dump to print regions information
             arena_dump(&my_arena);
@@ -47,13 +49,13 @@ To include the implementation, define `ARENA_ALLOCATOR_IMPLEMENTATION` **in exac
 
     ==> TODOs for Arena Allocator:
         - [x] Dynamic array manipulation.
-        - [ ] Store Region meta data out of band
+        - [x] Store Region meta data out of band
         - [x] String handling and management.
-        - [ ] Implement a better reallocation strategy to minimize wasted memory.
-        - [ ] Improve memory alignment.
+        - [x] Implement a better reallocation strategy to minimize wasted memory.
+        - [x] Improve memory alignment.
         - [ ] Implement debugging utilities for tracking memory usage.
         - [x] Implement thread safety with mutex locking
-        - [ ] Add thread-local storage support for better multi-threaded performance
+        - [x] Add thread-local storage support for better multi-threaded performance
 
 
 */
@@ -61,25 +63,198 @@ To include the implementation, define `ARENA_ALLOCATOR_IMPLEMENTATION` **in exac
 #define ARENA_ALLOCATOR
 #include <sys/mman.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /*__linux__*/
+
+/* Defining ARENA_USE_LIBC makes arena_memcpy and arena_strlen call memcpy and strlen */
+#ifdef ARENA_USE_LIBC
+#include <string.h>
+#endif /*ARENA_USE_LIBC*/
+
+/*
+    Building with ARENA_ATOMIC turns the allocation fast path into a C11 compare-and-swap on the
+    current region's count, the mutex is then only taken to move the cursor or append a new region.
+*/
+#ifdef ARENA_ATOMIC
+#include <stdatomic.h>
+#define ARENA_ATOMIC_QUAL _Atomic
+#else
+#define ARENA_ATOMIC_QUAL
+#endif /*ARENA_ATOMIC*/
+
+/* How many regions left behind by the cursor are still tried before moving on, 0 disables the look-back */
+#ifndef ARENA_LOOKBACK_REGIONS
+#define ARENA_LOOKBACK_REGIONS          4
+#endif /*ARENA_LOOKBACK_REGIONS */
 
 typedef struct Region Region;
 
+/* Region descriptors live in the arena's descriptor array, the mapping itself holds only user data */
+#define ARENA_REGION_HUGETLB     1u
+#define ARENA_REGION_THP         2u
+#define ARENA_REGION_RESERVED    4u   /* PROT_NONE reservation, committed grows with the bump pointer */
+#define ARENA_REGION_CHILD       8u   /* borrowed from the parent arena, given back to it instead of unmapped */
+#define ARENA_REGION_MIRRORED   16u   /* capacity bytes of a memfd mapped twice back to back, see ArenaRing */
+
 struct Region{
-    Region *next;
+    unsigned flags;                  /* ARENA_REGION_* describing how the mapping was made */
     size_t capacity;
-    size_t count;
-    size_t remaining;
+    size_t ARENA_ATOMIC_QUAL committed;  /* bytes usable right now, equal to capacity unless reserved */
+    size_t ARENA_ATOMIC_QUAL count;  /* free space is committed - count, so one CAS publishes an allocation */
+    size_t ARENA_ATOMIC_QUAL dirty;  /* pages past max(dirty, count) were never touched or have been purged */
+    uint64_t idle_since;             /* when count was last lowered, in milliseconds, used by decay purging.
+                                        Bumps do not update it, it approximates when the region went idle */
     unsigned char *bytes;
 };
 
-typedef struct {
-    Region *head;
-    Region *tail;
+typedef struct Arena Arena;
+typedef struct ArenaThreadCache ArenaThreadCache;
+typedef struct ArenaFreeBlock ArenaFreeBlock;
+typedef struct ArenaHeap ArenaHeap;
+typedef struct ArenaHeapBlock ArenaHeapBlock;
+
+/* A chunk carved out of an arena that one thread bump-allocates from without locking */
+struct ArenaThreadCache{
+    Arena *arena;
+    Region *region;
+    unsigned char *cur;
+    unsigned char *end;
+    ArenaThreadCache *next;
+    ArenaThreadCache *prev;
+};
+
+/* A block orphaned by arena_realloc, the link lives in the block itself */
+struct ArenaFreeBlock{
+    ArenaFreeBlock *next;
+    size_t size;
+};
+
+/* How arena__append__region sizes the regions it maps */
+typedef enum{
+    ARENA_GROWTH_FIXED,        /* ARENA_REGION_DEFAULT_CAPACITY, or exactly what a larger request needs */
+    ARENA_GROWTH_GEOMETRIC,    /* every new region doubles the previous one up to max_region_size */
+    ARENA_GROWTH_ADAPTIVE      /* geometric, and arena_reset learns the size from the high-water mark */
+} ArenaGrowth;
+
+/* Huge page backing for the regions of an arena, both fall back to normal pages when unavailable */
+typedef enum{
+    ARENA_HUGE_NONE,
+    ARENA_HUGE_THP,            /* 2 MB aligned regions advised with MADV_HUGEPAGE */
+    ARENA_HUGE_HUGETLB         /* MAP_HUGETLB from the hugetlbfs pool, then ARENA_HUGE_THP */
+} ArenaHugePages;
+
+/* What arena_reset does with the regions beyond the retained ones */
+typedef enum{
+    ARENA_RELEASE_NONE,        /* keep every region resident */
+    ARENA_RELEASE_UNMAP,       /* munmap them, or hand them to the region cache */
+    ARENA_RELEASE_DONTNEED,    /* keep the mapping, MADV_DONTNEED drops the pages right away */
+    ARENA_RELEASE_FREE         /* keep the mapping, MADV_FREE lets the kernel reclaim them lazily */
+} ArenaRelease;
+
+/* Per arena options for arena_init_ex, a zeroed config gives the arena_init defaults */
+typedef struct{
+    ArenaGrowth growth;
+    size_t max_region_size;    /* cap for geometric and adaptive growth, 0 means ARENA_REGION_MAX_CAPACITY */
+    ArenaHugePages huge_pages;
+    size_t reserve;            /* reserve this much address space as one region and commit it on demand, 0 disables */
+    size_t decommit_watermark; /* in reserve mode arena_reset decommits above this offset, 0 keeps every committed page */
+    ArenaRelease release;      /* retention policy of arena_reset, the first region is always kept */
+    size_t retain_bytes;       /* keep regions resident until this many bytes are covered */
+    size_t retain_regions;     /* keep at least this many regions resident */
+    unsigned retain_decay;     /* if non-zero also retain an average of recent peaks, each peak weighs 1/2^retain_decay */
+    int heap;                  /* run a TLSF heap over the regions so blocks can be given back with arena_free */
+} ArenaConfig;
+
+/* Filled by arena_stats */
+typedef struct{
+    size_t regions;
+    size_t capacity;           /* bytes mapped for user data, reserved address space included */
+    size_t committed;          /* part of capacity that is readable and writable */
+    size_t used;               /* bytes handed out, including alignment padding */
+    size_t hugetlb_bytes;      /* capacity backed by MAP_HUGETLB pages */
+    size_t thp_bytes;          /* capacity advised with MADV_HUGEPAGE, backing is up to the kernel */
+    size_t free_bytes;         /* blocks orphaned by arena_realloc waiting to be reused */
+    size_t recycled_bytes;     /* bytes handed out again from those blocks since arena_init */
+} ArenaStats;
+
+/* Fixed-size object pool carving its items out of an arena, see ARENA_POOL */
+typedef struct{
+    Arena *arena;
+    size_t item_size;          /* at least a pointer, freed items hold the free list link */
+    size_t item_align;
+    size_t slab_items;         /* items carved from the arena at a time */
+    unsigned char *slab_cur;   /* unused part of the last slab */
+    unsigned char *slab_end;
+    void *free;                /* intrusive free list */
+    size_t magazine;           /* items each thread may keep to itself, 0 disables magazines */
+    unsigned long id;          /* tells magazines of a re-initialized pool from stale ones */
+} ArenaPool;
+
+/* A position in an arena returned by arena_mark, everything allocated after it can be dropped with arena_rewind */
+typedef struct{
+    Region *region;
+    size_t count;
+} ArenaMark;
+
+/* A temporary region of one of the calling thread's scratch arenas, see arena_scratch_begin */
+typedef struct{
+    Arena *arena;
+    ArenaMark mark;
+} ArenaScratch;
+
+struct Arena{
+    Region *regions;            /* descriptors in allocation order, the array never moves */
+    size_t nregions;
+    size_t max_regions;         /* capacity of the descriptor array */
+    Region *ARENA_ATOMIC_QUAL curr;   /* allocation cursor, regions after it are empty */
+    Region *lookback[ARENA_LOOKBACK_REGIONS > 0 ? ARENA_LOOKBACK_REGIONS : 1]; /* regions left behind with free tail space */
+    size_t lookback_pos;
+    pthread_mutex_t mutex;
+    size_t tc_chunk;            /* 0 when thread caches are disabled */
+    ArenaThreadCache *tc_list;  /* thread caches currently holding a chunk of this arena */
+    ArenaConfig config;
+    ArenaHeap *heap;            /* TLSF bookkeeping in heap mode, NULL otherwise */
+    size_t next_region_size;    /* size of the next region mapped by geometric and adaptive growth */
+    size_t peak_average;        /* decaying average of the bytes in use at arena_reset */
+    ArenaFreeBlock *free_lists[sizeof(size_t) * 8]; /* orphaned blocks by floor(log2(size)) */
+    size_t ARENA_ATOMIC_QUAL free_mask; /* bit k is set while free_lists[k] is not empty */
+    size_t free_bytes;
+    size_t recycled_bytes;
+    int registered;             /* linked into the process-wide registry, see arena_register */
+    Arena *registry_next;
+    Arena *registry_prev;
+    Arena *parent;              /* set by arena_init_child, regions are borrowed from it */
+};
+
+/* Most arenas a frame arena can rotate through */
+#ifndef ARENA_FRAME_MAX_ARENAS
+#define ARENA_FRAME_MAX_ARENAS          4
+#endif /*ARENA_FRAME_MAX_ARENAS */
+
+/* count arenas used in turn, one per frame, see arena_frame_advance */
+typedef struct{
+    Arena arenas[ARENA_FRAME_MAX_ARENAS];
+    size_t count;
+    size_t current;
+} ArenaFrame;
+
+/*
+    Circular arena, blocks are allocated at the head and given back at the tail. Each block is
+    preceded by a header holding its size, the low bit is set once the block is released.
+*/
+typedef struct{
+    Region region;             /* mirrored when the kernel allows it, so no block wraps around */
+    size_t head;               /* bytes ever allocated, head - tail are in use */
+    size_t tail;               /* bytes ever given back */
     pthread_mutex_t mutex;
-} Arena;
+} ArenaRing;
 
 
 #define ARENA_ARR(name, type) \
@@ -89,14 +264,134 @@ typedef struct {
         size_t capacity; \
     } name
 
+/*
+    Typed pool of fixed-size objects, ARENA_POOL(NodePool, Node) defines NodePool with
+        void NodePool_init(NodePool *pool, Arena *arena, size_t magazine);
+        Node *NodePool_get(NodePool *pool);
+        void NodePool_put(NodePool *pool, Node *item);
+    The functions are static inline definitions, so use it at file scope, once per type
+    in each translation unit. Inside a function it fails with "invalid storage class".
+*/
+#define ARENA_POOL(name, type) \
+    typedef struct name { \
+        ArenaPool pool; \
+    } name; \
+    static inline void name##_init(name *p, Arena *arena, size_t magazine) { \
+        arena_pool_init(&p->pool, arena, sizeof(type), _Alignof(type), magazine); \
+    } \
+    static inline type *name##_get(name *p) { \
+        return (type*)arena_pool_get(&p->pool); \
+    } \
+    static inline void name##_put(name *p, type *item) { \
+        arena_pool_put(&p->pool, item); \
+    }
+
 #define ARENA_REGION_SIZE        (sizeof(Region))
 #define ARENA_PAGE_SIZE          (sysconf(_SC_PAGESIZE))
 #define ARENA_SIZE_ARR(arr)      (sizeof(arr) / sizeof((arr)[0]))
+#define ARENA_IS_POW2(x)         ((x) != 0 && ((x) & ((x) - 1)) == 0)
 
 #ifndef ARENA_REGION_DEFAULT_CAPACITY
 #define ARENA_REGION_DEFAULT_CAPACITY   (ARENA_PAGE_SIZE * 2)
 #endif /*ARENA_REGION_DEFAULT_CAPACITY */
 
+/* Alignment of blocks returned by arena_alloc, define it as 1 to pack allocations tightly */
+#ifndef ARENA_DEFAULT_ALIGNMENT
+#define ARENA_DEFAULT_ALIGNMENT         (_Alignof(max_align_t))
+#endif /*ARENA_DEFAULT_ALIGNMENT */
+
+#ifndef ARENA_CACHE_LINE_SIZE
+#define ARENA_CACHE_LINE_SIZE           64
+#endif /*ARENA_CACHE_LINE_SIZE */
+
+/* Capacity of the descriptor array. It is reserved up front so that descriptors never move,
+   only the pages actually used are backed by memory (ARENA_MAX_REGIONS * sizeof(Region) bytes of
+   address space, 56 MB by default on 64-bit targets) */
+#ifndef ARENA_MAX_REGIONS
+#define ARENA_MAX_REGIONS               (1 << 20)
+#endif /*ARENA_MAX_REGIONS */
+
+/* Capacity of a child arena's descriptor array, which is carved out of the parent. Children
+   grow geometrically, so this covers far more than the parent can lend */
+#ifndef ARENA_CHILD_MAX_REGIONS
+#define ARENA_CHILD_MAX_REGIONS         64
+#endif /*ARENA_CHILD_MAX_REGIONS */
+
+#ifndef ARENA_HUGE_PAGE_SIZE
+#define ARENA_HUGE_PAGE_SIZE            ((size_t)2 * 1024 * 1024)
+#endif /*ARENA_HUGE_PAGE_SIZE */
+
+/* Reserve mode commits memory in steps of this many bytes, must be a power of two multiple of the page size */
+#ifndef ARENA_COMMIT_GRANULARITY
+#define ARENA_COMMIT_GRANULARITY        ((size_t)64 * 1024)
+#endif /*ARENA_COMMIT_GRANULARITY */
+
+/* Byte cap of the process-wide cache of freed regions, 0 disables it, see arena_cache_set_limit */
+#ifndef ARENA_REGION_CACHE_LIMIT
+#define ARENA_REGION_CACHE_LIMIT        0
+#endif /*ARENA_REGION_CACHE_LIMIT */
+
+/* How many descriptor arrays of destroyed arenas the region cache keeps around */
+#ifndef ARENA_CACHE_DESCRIPTOR_ARRAYS
+#define ARENA_CACHE_DESCRIPTOR_ARRAYS   8
+#endif /*ARENA_CACHE_DESCRIPTOR_ARRAYS */
+
+#ifndef ARENA_REGION_MAX_CAPACITY
+#define ARENA_REGION_MAX_CAPACITY       (ARENA_PAGE_SIZE * 16384)
+#endif /*ARENA_REGION_MAX_CAPACITY */
+
+#ifndef ARENA_THREAD_CACHE_CHUNK
+#define ARENA_THREAD_CACHE_CHUNK        (ARENA_PAGE_SIZE * 4)
+#endif /*ARENA_THREAD_CACHE_CHUNK */
+
+/* Number of arenas a single thread can cache chunks from at the same time */
+#ifndef ARENA_THREAD_CACHE_SLOTS
+#define ARENA_THREAD_CACHE_SLOTS        4
+#endif /*ARENA_THREAD_CACHE_SLOTS */
+
+#ifndef ARENA_THREAD_LOCAL
+#define ARENA_THREAD_LOCAL              _Thread_local
+#endif /*ARENA_THREAD_LOCAL */
+
+/* Number of thread-local scratch arenas, two are enough as long as a function takes at most one arena argument */
+#ifndef ARENA_SCRATCH_COUNT
+#define ARENA_SCRATCH_COUNT             2
+#endif /*ARENA_SCRATCH_COUNT */
+
+#ifndef ARENA_SCRATCH_CAPACITY
+#define ARENA_SCRATCH_CAPACITY          (ARENA_PAGE_SIZE * 16)
+#endif /*ARENA_SCRATCH_CAPACITY */
+
+/* Defaults of arena_purge_start when it is passed 0 */
+#ifndef ARENA_PURGE_INTERVAL_MS
+#define ARENA_PURGE_INTERVAL_MS         1000
+#endif /*ARENA_PURGE_INTERVAL_MS */
+
+#ifndef ARENA_PURGE_DECAY_MS
+#define ARENA_PURGE_DECAY_MS            10000
+#endif /*ARENA_PURGE_DECAY_MS */
+
+/* Bytes a pool carves out of its arena whenever its free list runs dry */
+#ifndef ARENA_POOL_SLAB_SIZE
+#define ARENA_POOL_SLAB_SIZE            ((size_t)16 * 1024)
+#endif /*ARENA_POOL_SLAB_SIZE */
+
+/* Number of pools a single thread keeps a magazine for at the same time */
+#ifndef ARENA_POOL_MAGAZINE_SLOTS
+#define ARENA_POOL_MAGAZINE_SLOTS       4
+#endif /*ARENA_POOL_MAGAZINE_SLOTS */
+
+/* arena_memcpy switches to non-temporal stores for copies this large, bigger than most L2 caches */
+#ifndef ARENA_MEMCPY_STREAM_THRESHOLD
+#define ARENA_MEMCPY_STREAM_THRESHOLD   ((size_t)4 * 1024 * 1024)
+#endif /*ARENA_MEMCPY_STREAM_THRESHOLD */
+
+/* arena_alloc_zeroed hands dirty spans this large back with MADV_DONTNEED instead of clearing them,
+   the kernel maps zero pages again on first touch. Measured with bench.c on sparsely written tables,
+   tables that end up written page by page are better served by a larger value */
+#ifndef ARENA_ZERO_DONTNEED_THRESHOLD
+#define ARENA_ZERO_DONTNEED_THRESHOLD   ((size_t)4 * 1024 * 1024)
+#endif /*ARENA_ZERO_DONTNEED_THRESHOLD */
 
 #ifndef ARENA_ARR_INIT_CAPACITY
 #define ARENA_ARR_INIT_CAPACITY 256
@@ -104,37 +399,296 @@ typedef struct {
 
 /*Functions declarations*/
 void arena_init(Arena *arena, size_t size);
+void arena_init_ex(Arena *arena, size_t size, const ArenaConfig *config); /* config may be NULL */
+/* An arena whose regions are carved out of parent and handed back to it by arena_reset and
+   arena_destroy. The child must be destroyed before the parent is reset, rewound or destroyed */
+void arena_init_child(Arena *parent, Arena *child, size_t size);
 void *arena_alloc(Arena *arena, size_t size);
+void *arena_alloc_aligned(Arena *arena, size_t size, size_t align); /* align must be a power of two */
+void *arena_alloc_cacheline(Arena *arena, size_t size);
+void *arena_alloc_page(Arena *arena, size_t size);
+/* Zero-filled blocks, only the bytes earlier allocations may have written are cleared */
+void *arena_alloc_zeroed(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t n, size_t size);  /* NULL if n * size overflows */
 void *arena_realloc(Arena *arena, void *oldptr, size_t oldsz, size_t newsz);
-size_t arena_strlen(const char *str); /* this is implemented  instead of including <string.h>*/
-void *arena_memcpy(void *dest, const void *src, size_t n); /* just like arena_strlen*/
+/* Fill out[i] with a block of sizes[i] (or size) bytes each, taking the mutex at most once.
+   Return 0 and fill out with NULL if the batch size overflows */
+int arena_alloc_batch(Arena *arena, const size_t *sizes, void **out, size_t n);
+int arena_alloc_n(Arena *arena, size_t size, size_t count, void **out);
+void arena_free(Arena *arena, void *ptr);   /* only heap mode arenas reuse the block, otherwise a no-op */
+size_t arena_strlen(const char *str); /* this is implemented  instead of including <string.h>, unless ARENA_USE_LIBC is defined */
+void *arena_memcpy(void *dest, const void *src, size_t n); /* just like arena_strlen, returns dest like memcpy */
 void arena_dump(Arena *arena);
-
-/* Must be used only when no other threads are using the arena*/
+void arena_stats(Arena *arena, ArenaStats *stats);
+
+/* Process-wide cache of freed regions, thread-safe */
+void arena_cache_set_limit(size_t bytes);   /* 0 disables the cache and releases what it holds */
+void arena_cache_trim(void);                /* unmaps every cached region */
+size_t arena_cache_bytes(void);
+
+/* Process-wide registry of arenas whose idle pages are given back to the kernel, thread-safe.
+   arena_destroy unregisters the arena itself */
+void arena_register(Arena *arena);
+void arena_unregister(Arena *arena);
+size_t arena_purge_all(void);       /* purges every registered arena right away, returns the bytes released */
+void arena_purge_start(unsigned interval_ms, unsigned decay_ms); /* background thread purging pages idle for decay_ms */
+void arena_purge_stop(void);
+
+/* Pools share the arena mutex. magazine is how many freed items each thread keeps without locking,
+   0 disables magazines. arena_reset and arena_rewind drop every item, the pool must be initialized again */
+void arena_pool_init(ArenaPool *pool, Arena *arena, size_t item_size, size_t item_align, size_t magazine);
+void *arena_pool_get(ArenaPool *pool);
+void arena_pool_put(ArenaPool *pool, void *item);
+
+/* Must be called before the arena is shared between threads, chunk_size 0 means ARENA_THREAD_CACHE_CHUNK */
+void arena_thread_cache_enable(Arena *arena, size_t chunk_size);
+
+/* Must be used only when no other threads are using the arena. With thread caches, threads that
+   still hold a chunk of it must not call any arena function meanwhile, on this arena or another */
 void arena_reset(Arena *arena);
 void arena_destroy(Arena *arena);
 
+/* Marks must be rewound in LIFO order, and arena_rewind* must be used only when no other threads are using the arena */
+ArenaMark arena_mark(Arena *arena);
+void arena_rewind(Arena *arena, ArenaMark mark);
+void arena_rewind_trim(Arena *arena, ArenaMark mark); /* also unmaps the regions emptied by the rewind */
+
+/* Stack allocation, arena_pop gives back the block of the matching arena_push. Blocks must be
+   popped in LIFO order, a block something else was allocated after stays until arena_reset */
+void *arena_push(Arena *arena, size_t size);
+void arena_pop(Arena *arena, void *ptr);
+
+/* Returns a thread-local scratch arena that is none of the n conflicts, everything allocated
+   from it is dropped by the matching arena_scratch_end */
+ArenaScratch arena_scratch_begin(Arena **conflicts, size_t n);
+void arena_scratch_end(ArenaScratch scratch);
+
+/* Frame arenas rotate through count >= 2 arenas: what frame N allocates stays valid during the
+   next count - 1 frames and is reset in bulk when arena_frame_advance starts frame N + count.
+   arena_frame_advance must be called while no other thread allocates from the frame */
+void arena_frame_init(ArenaFrame *frame, size_t count, size_t size);
+Arena *arena_frame_advance(ArenaFrame *frame);  /* returns the arena of the new frame */
+Arena *arena_frame_current(ArenaFrame *frame);
+Arena *arena_frame_previous(ArenaFrame *frame); /* the arena of the frame before the current one */
+void arena_frame_destroy(ArenaFrame *frame);
+
+/* Ring arenas are thread-safe. Released blocks are reclaimed in allocation order, a block
+   released early is reclaimed once every older block is released too */
+void arena_ring_init(ArenaRing *ring, size_t capacity);
+void *arena_ring_alloc(ArenaRing *ring, size_t size);   /* NULL when the ring is full */
+void arena_ring_release(ArenaRing *ring, void *ptr);
+size_t arena_ring_used(ArenaRing *ring);
+void arena_ring_destroy(ArenaRing *ring);
+
 /*Private Functions declarations*/
+void arena__init(Arena *arena, size_t size, const ArenaConfig *config, Arena *parent);
 void *arena__alloc__unlocked(Arena *arena, size_t size);
-Region* arena__new__region(size_t capacity);
-void arena__append__region(Arena *arena, size_t size);
+void *arena__alloc__aligned__unlocked(Arena *arena, size_t size, size_t align);
+void *arena__alloc__region(Arena *arena, size_t size, size_t align, Region **out);
+void *arena__alloc__zeroed(Arena *arena, size_t size, size_t align);
+void arena__zero(void *ptr, size_t n);
+void arena__zero__dirty(Region *region, unsigned char *ptr, size_t n);
+int arena__region__move(Region *region, size_t from, size_t to);
+void *arena__tc__alloc(Arena *arena, size_t size, size_t align);
+ArenaThreadCache *arena__tc__slot(Arena *arena);
+void arena__tc__release(ArenaThreadCache *tc);
+void arena__tc__drop__all(Arena *arena);
+void arena__tc__thread__exit(void *slots);
+void arena__thread__register(void);
+void arena__thread__exit(void *unused);
+void arena__new__region(Region *region, size_t capacity, ArenaHugePages huge);
+void *arena__map__aligned(size_t size, size_t align);
+void arena__reserve__region(Region *region, size_t reserve, size_t commit, ArenaHugePages huge);
+int arena__region__commit(Region *region, size_t need);
+void arena__region__decommit(Region *region, size_t keep);
+void *arena__cache__get(size_t size, size_t *got);
+int arena__cache__put(void *ptr, size_t size);
+void arena__cache__shrink(size_t limit);
+void *arena__descriptors__get(void);
+void arena__descriptors__put(void *ptr);
+Region *arena__push__region(Arena *arena, size_t size);
+void *arena__append__region(Arena *arena, size_t size, size_t align, Region **out);
+size_t arena__region__size(Arena *arena, size_t size);
+void arena__adapt(Arena *arena);
+void arena__retain(Arena *arena);
+void arena__region__lower(Region *region, size_t count, uint64_t now);
+void arena__region__dirty(Region *region, size_t upto);
+size_t arena__purge(Arena *arena, uint64_t now, uint64_t decay_ms);
+void *arena__purge__thread(void *unused);
+uint64_t arena__now__ms(void);
+size_t arena__batch__stride(size_t size);
+void arena__batch__heap(Arena *arena, const size_t *sizes, size_t size, void **out, size_t n);
+int arena__batch__fail(void **out, size_t n);
+void arena__heap__init(Arena *arena);
+void arena__heap__add(ArenaHeap *heap, Region *region);
+void arena__heap__mapping(size_t size, size_t *fl, size_t *sl);
+size_t arena__heap__round(size_t size);
+void arena__heap__insert(ArenaHeap *heap, ArenaHeapBlock *block);
+void arena__heap__remove(ArenaHeap *heap, ArenaHeapBlock *block);
+ArenaHeapBlock *arena__heap__find(ArenaHeap *heap, size_t size);
+void arena__heap__split(ArenaHeap *heap, ArenaHeapBlock *block, size_t size);
+void *arena__heap__alloc(Arena *arena, size_t size, size_t align);
+void arena__heap__free(ArenaHeap *heap, void *ptr);
+void *arena__heap__realloc(Arena *arena, void *ptr, size_t size);
+void arena__heap__reset(Arena *arena);
+void *arena__pool__take(ArenaPool *pool);
+size_t arena__free__class(size_t size);
+int arena__free__waiting(Arena *arena, size_t size);
+void *arena__free__get(Arena *arena, size_t size);
+void arena__free__put(Arena *arena, void *ptr, size_t size);
+void arena__free__clear(Arena *arena);
+void arena__lookback__push(Arena *arena, Region *region);
+void arena__lookback__clear(Arena *arena);
+void arena__curr__retreat(Arena *arena, Region *region);
+Region *arena__region__owner(Arena *arena, const void *ptr);
+int arena__resize__in__place(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+Region *arena__rewind(Arena *arena, ArenaMark mark);
 size_t arena__align__size(size_t size);
+void *arena__memcpy__word(void *dest, const void *src, size_t n);
+size_t arena__strlen__word(const char *str);
+void arena__simd__select(void);
 void arena__region__dump(Region* region);
-void arena__free__region(Region* region);
+void arena__free__region(Arena *arena, Region* region);
+void *arena__child__take(Arena *parent, size_t size, Region **from);
+void arena__child__region(Arena *arena, Region *region, size_t size);
+void arena__child__return(Arena *parent, void *ptr, size_t size);
+int arena__ring__mirror(Region *region, size_t size);
+
+/* Reserves size bytes aligned to align at the end of the region, returns NULL when they do not fit.
+   Defined here so that the typed allocation macros can inline it */
+static inline void*
+arena__region__bump(Region *region, size_t size, size_t align)
+{
+    size_t count, pad, limit;
+
+#ifdef ARENA_ATOMIC
+    /* committed only grows while other threads may allocate, a stale value just sends us to the slow path */
+    limit = atomic_load_explicit(&region->committed, memory_order_acquire);
+    /* Acquire pairs with the release of a lowered count, the dirty mark raised before it is then
+       visible to whoever zeroes the block */
+    count = atomic_load_explicit(&region->count, memory_order_acquire);
+    do{
+        pad = -(uintptr_t)(region->bytes + count) & (align - 1);
+        if(count > limit || pad > limit - count || size > limit - count - pad)
+            return NULL;
+    } while(!atomic_compare_exchange_weak_explicit(&region->count, &count, count + pad + size,
+                                                   memory_order_acquire, memory_order_acquire));
+#else
+    limit = region->committed;
+    count = region->count;
+    pad = -(uintptr_t)(region->bytes + count) & (align - 1);
+    if(pad > limit - count || size > limit - count - pad)
+        return NULL;
+    region->count = count + pad + size;
+#endif /*ARENA_ATOMIC*/
+
+    return (void*)(region->bytes + count + pad);
+}
+
+/*
+    Typed allocation, sizeof and _Alignof are folded at compile time and array sizes are checked
+    for overflow (the macros yield NULL instead of a short block). Types aligned beyond
+    ARENA_DEFAULT_ALIGNMENT get their own alignment. With ARENA_ATOMIC the bump on the cursor
+    region is inlined into the caller, the mutex build calls arena_alloc_aligned directly.
+    The zeroed variants go through arena_alloc_zeroed, which skips pages that are still fresh.
+        Node *node  = arena_new(&arena, Node);
+        int *counts = arena_new_array_zeroed(&arena, int, n);
+*/
+#define arena_new(arena, T)                 ((T*)arena__new((arena), 1, sizeof(T), _Alignof(T)))
+#define arena_new_array(arena, T, n)        ((T*)arena__new((arena), (n), sizeof(T), _Alignof(T)))
+#define arena_new_zeroed(arena, T)          ((T*)arena__new__zeroed((arena), 1, sizeof(T), _Alignof(T)))
+#define arena_new_array_zeroed(arena, T, n) ((T*)arena__new__zeroed((arena), (n), sizeof(T), _Alignof(T)))
+
+static inline void*
+arena__new(Arena *arena, size_t n, size_t size, size_t align)
+{
+    if(size != 0 && n > (size_t)-1 / size){
+        assert(!"arena_new_array size overflows");
+        return NULL;
+    }
+    size *= n;
+    if(align < ARENA_DEFAULT_ALIGNMENT)
+        align = ARENA_DEFAULT_ALIGNMENT;
+
+#ifdef ARENA_ATOMIC
+    /* Same conditions as the lock-free path of arena_alloc_aligned, minus the size class lookup */
+    if(arena->tc_chunk == 0 && arena->heap == NULL
+       && atomic_load_explicit(&arena->free_mask, memory_order_relaxed) == 0){
+        void *ptr = arena__region__bump(atomic_load_explicit(&arena->curr, memory_order_acquire), size, align);
+        if(ptr != NULL)
+            return ptr;
+    }
+#endif /*ARENA_ATOMIC*/
+    return arena_alloc_aligned(arena, size, align);
+}
+
+static inline void*
+arena__new__zeroed(Arena *arena, size_t n, size_t size, size_t align)
+{
+    if(size != 0 && n > (size_t)-1 / size){
+        assert(!"arena_new_array_zeroed size overflows");
+        return NULL;
+    }
+    if(align < ARENA_DEFAULT_ALIGNMENT)
+        align = ARENA_DEFAULT_ALIGNMENT;
+    return arena__alloc__zeroed(arena, n * size, align);
+}
 
 #endif /*ARENA_ALLOCATOR*/
 
 
 #ifdef ARENA_ALLOCATOR_IMPLEMENTATION
 
+/*
+    Heap mode, a Two-Level Segregated Fit allocator (Masmano et al.) over the arena's regions.
+    Free blocks are filed by size in a two-level table: the first level is floor(log2(size)),
+    the second splits each power of two into ARENA_HEAP_SL_COUNT linear ranges. A bitmap per
+    level finds the first non-empty list at least as large as the request with two
+    find-first-set instructions, so allocation and free run in constant time. Freed blocks
+    are merged with their free physical neighbours right away.
+    Each block starts with a header holding the previous physical block and the payload size,
+    the free list links live in the payload. Every region ends with a used sentinel header so
+    neighbour lookups never leave it. Regions handed to the heap have their count set to the
+    capacity, the bump allocator never touches them.
+*/
+#define ARENA_HEAP_ALIGN_LOG2   4
+#define ARENA_HEAP_ALIGN        ((size_t)1 << ARENA_HEAP_ALIGN_LOG2)
+#define ARENA_HEAP_SL_LOG2      5
+#define ARENA_HEAP_SL_COUNT     (1 << ARENA_HEAP_SL_LOG2)
+#define ARENA_HEAP_FL_SHIFT     (ARENA_HEAP_SL_LOG2 + ARENA_HEAP_ALIGN_LOG2)
+#define ARENA_HEAP_FL_COUNT     32
+#define ARENA_HEAP_SMALL        ((size_t)1 << ARENA_HEAP_FL_SHIFT)
+#define ARENA_HEAP_HEADER       (offsetof(ArenaHeapBlock, next_free))
+#define ARENA_HEAP_MIN          (sizeof(ArenaHeapBlock) - ARENA_HEAP_HEADER)
+#define ARENA_HEAP_FREE         ((size_t)1)
+
+struct ArenaHeapBlock{
+    ArenaHeapBlock *prev_phys;  /* NULL for the first block of a region */
+    size_t size;                /* payload bytes, ARENA_HEAP_FREE in the low bit */
+    ArenaHeapBlock *next_free;  /* only valid while the block is free */
+    ArenaHeapBlock *prev_free;
+};
+
+struct ArenaHeap{
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[ARENA_HEAP_FL_COUNT];
+    ArenaHeapBlock *blocks[ARENA_HEAP_FL_COUNT][ARENA_HEAP_SL_COUNT];
+    size_t used;                /* bytes of allocated blocks, headers included */
+};
+
+_Static_assert(offsetof(ArenaHeapBlock, next_free) == ARENA_HEAP_ALIGN, "heap block header must keep payloads aligned");
+
+#define ARENA_HEAP_SIZE(b)      ((b)->size & ~ARENA_HEAP_FREE)
+#define ARENA_HEAP_PAYLOAD(b)   ((void*)((unsigned char*)(b) + ARENA_HEAP_HEADER))
+#define ARENA_HEAP_BLOCK(p)     ((ArenaHeapBlock*)((unsigned char*)(p) - ARENA_HEAP_HEADER))
+#define ARENA_HEAP_NEXT(b)      ((ArenaHeapBlock*)((unsigned char*)(b) + ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(b)))
+
 size_t
 arena__align__size(size_t size)
 {
-    size_t size_page_aligned, page_size, region_size, size_bytes;
-    region_size = ARENA_REGION_SIZE;
+    size_t size_page_aligned, page_size;
     page_size = sysconf(_SC_PAGESIZE);
-    size_bytes = region_size + size;
-    size_page_aligned = (size_bytes + page_size - 1) & ~(page_size - 1);
+    size_page_aligned = (size + page_size - 1) & ~(page_size - 1);
     return size_page_aligned;
 }
 
@@ -142,62 +696,292 @@ arena__align__size(size_t size)
 void
 arena_init(Arena *arena, size_t size)
 {
-    Region *region;
+    arena_init_ex(arena, size, NULL);
+}
+
+void
+arena_init_ex(Arena *arena, size_t size, const ArenaConfig *config)
+{
+    arena__init(arena, size, config, NULL);
+}
+
+void
+arena_init_child(Arena *parent, Arena *child, size_t size)
+{
+    /* Everything past the first region goes back to the parent on reset */
+    ArenaConfig config = {0};
+    config.release = ARENA_RELEASE_UNMAP;
+    config.growth  = ARENA_GROWTH_GEOMETRIC;
+
+    assert(parent != NULL && parent != child);
+    assert(parent->regions != NULL);
+    assert(parent->heap == NULL && "heap mode arenas cannot lend regions");
+    arena__init(child, size, &config, parent);
+}
+
+void
+arena__init(Arena *arena, size_t size, const ArenaConfig *config, Arena *parent)
+{
+    void *ptr;
+    size_t i;
     int ret;
     size = arena__align__size(size);
-    region = arena__new__region(size);
+    if(size < (size_t)ARENA_REGION_DEFAULT_CAPACITY)
+        size = (size_t)ARENA_REGION_DEFAULT_CAPACITY;
 
-    arena->head = region;
-    arena->tail = region;
+    if(config != NULL){
+        arena->config = *config;
+    } else{
+        arena->config = (ArenaConfig){0};
+    }
+    arena->parent = parent;
+    if(arena->config.max_region_size == 0)
+        arena->config.max_region_size = ARENA_REGION_MAX_CAPACITY;
+    arena->next_region_size = size * 2;
+    arena->peak_average = 0;
+
+    if(parent != NULL){
+        /* A child's descriptors come from the parent too, so that it costs no syscall at all.
+           Whole pages, the first region then follows without padding and both roll back */
+        ret = pthread_mutex_lock(&parent->mutex);
+        assert(ret == 0);
+        ptr = arena__child__take(parent, arena__align__size(ARENA_CHILD_MAX_REGIONS * sizeof(Region)), NULL);
+        ret = pthread_mutex_unlock(&parent->mutex);
+        assert(ret == 0);
+        arena->max_regions = ARENA_CHILD_MAX_REGIONS;
+    } else{
+        ptr = arena__descriptors__get();
+        arena->max_regions = ARENA_MAX_REGIONS;
+    }
+    arena->regions  = (Region*)ptr;
+    arena->nregions = 0;
+
+    if(arena->config.reserve != 0){
+        /* One contiguous region, arena__alloc__region commits it as the bump pointer moves */
+        arena__reserve__region(&arena->regions[0], arena->config.reserve, size, arena->config.huge_pages);
+        arena->nregions = 1;
+        arena->curr = &arena->regions[0];
+    } else{
+        arena->curr = arena__push__region(arena, size);
+    }
+    arena__lookback__clear(arena);
+    arena->tc_chunk = 0;
+    arena->tc_list = NULL;
+    arena->heap = NULL;
+    if(arena->config.heap)
+        arena__heap__init(arena);
+    for(i = 0; i < ARENA_SIZE_ARR(arena->free_lists); ++i)
+        arena->free_lists[i] = NULL;
+    arena->free_mask = 0;
+    arena->free_bytes = 0;
+    arena->recycled_bytes = 0;
+    arena->registered = 0;
+    arena->registry_next = NULL;
+    arena->registry_prev = NULL;
 
     /* Init the mutex */
     ret = pthread_mutex_init(&arena->mutex, NULL);
     assert(ret == 0);
 }
 
+/* Moves the region's count from `from` to `to`, fails if something else was bumped in between */
+int
+arena__region__move(Region *region, size_t from, size_t to)
+{
+    if(to > (size_t)region->committed)
+        return 0;
+    /* Raised before the move is published, a failed move only leaves a conservative mark.
+       The release orders the raise before the new count for every thread that bumps from it */
+    if(to < from)
+        arena__region__dirty(region, from);
+#ifdef ARENA_ATOMIC
+    return atomic_compare_exchange_strong_explicit(&region->count, &from, to,
+                                                   memory_order_release, memory_order_relaxed);
+#else
+    if(region->count != from)
+        return 0;
+    region->count = to;
+    return 1;
+#endif /*ARENA_ATOMIC*/
+}
+
+/*
+    Like arena__alloc__unlocked but also reports the region the block was carved from.
+    The common case is a single bump on the cursor region. When it is full the last few regions
+    the cursor left behind are tried, then the cursor advances over the empty regions kept by
+    arena_reset, and only then a new region is mapped. Must be called with the mutex held.
+*/
 void*
-arena__alloc__unlocked(Arena *arena, size_t size)
+arena__alloc__region(Arena *arena, size_t size, size_t align, Region **out)
 {
     Region *curr;
     void *ptr;
-    int ret;
+    size_t i;
 
     assert(arena != NULL);
-    assert(arena->head != NULL);
-
-    for(curr = arena->head; curr != NULL; curr = curr->next ){
-        if(size <= curr->remaining) {
-            ptr = (void*)(curr->bytes + curr->count);
-            curr->count      += size;
-            curr->remaining  -= size;
+    assert(arena->regions != NULL);
+
+    curr = arena->curr;
+    ptr = arena__region__bump(curr, size, align);
+    if(ptr != NULL)
+        goto found;
+
+    /* Reserve mode: commit more of the reservation before looking anywhere else */
+    if(arena__region__commit(curr, size + align - 1)){
+        ptr = arena__region__bump(curr, size, align);
+        if(ptr != NULL)
+            goto found;
+    }
 
-            return ptr;
+    for(i = 0; i < ARENA_SIZE_ARR(arena->lookback); ++i){
+        if(arena->lookback[i] == NULL)
+            continue;
+        ptr = arena__region__bump(arena->lookback[i], size, align);
+        if(ptr != NULL){
+            curr = arena->lookback[i];
+            goto found;
         }
     }
 
+    while(curr + 1 < arena->regions + arena->nregions){
+        arena__lookback__push(arena, curr);
+        curr++;
+        arena->curr = curr;
+        ptr = arena__region__bump(curr, size, align);
+        if(ptr != NULL)
+            goto found;
+    }
+
     // Allocate new region as no space available
-    arena__append__region(arena, size);
-    curr = arena->tail;
-    ptr = (void*)(curr->bytes + curr->count);
+    arena__lookback__push(arena, curr);
+    return arena__append__region(arena, size, align, out);
 
+found:
+    if(out != NULL)
+        *out = curr;
     return ptr;
 }
 
+/* Remembers a region the cursor moves away from, so small requests can still use its free tail */
+void
+arena__lookback__push(Arena *arena, Region *region)
+{
+#if ARENA_LOOKBACK_REGIONS > 0
+    if((size_t)region->committed - (size_t)region->count < ARENA_CACHE_LINE_SIZE)
+        return;
+    arena->lookback[arena->lookback_pos] = region;
+    arena->lookback_pos = (arena->lookback_pos + 1) % ARENA_LOOKBACK_REGIONS;
+#else
+    (void)arena;
+    (void)region;
+#endif /*ARENA_LOOKBACK_REGIONS*/
+}
+
+void
+arena__lookback__clear(Arena *arena)
+{
+    size_t i;
+    for(i = 0; i < ARENA_SIZE_ARR(arena->lookback); ++i)
+        arena->lookback[i] = NULL;
+    arena->lookback_pos = 0;
+}
+
+/* Called after region's count was rolled back. Moves the cursor back to region when every
+   region after it up to the cursor is empty, otherwise remembers region for look-back so its
+   freed tail is found again. Must be called with the mutex held */
+void
+arena__curr__retreat(Arena *arena, Region *region)
+{
+    Region *curr;
+    size_t i;
+
+    if(region >= arena->curr)
+        return;
+    for(curr = region + 1; curr <= arena->curr && curr->count == 0; ++curr)
+        ;
+    if(curr > arena->curr){
+        arena->curr = region;
+        arena__lookback__clear(arena);
+        return;
+    }
+    for(i = 0; i < ARENA_SIZE_ARR(arena->lookback); ++i){
+        if(arena->lookback[i] == region)
+            return;
+    }
+    arena__lookback__push(arena, region);
+}
+
+/* Region whose bytes hold ptr, NULL when none does */
+Region*
+arena__region__owner(Arena *arena, const void *ptr)
+{
+    const unsigned char *bytes = (const unsigned char*)ptr;
+    Region *curr;
+
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr){
+        if(bytes >= curr->bytes && bytes < curr->bytes + curr->capacity)
+            return curr;
+    }
+    return NULL;
+}
+
+void*
+arena__alloc__unlocked(Arena *arena, size_t size)
+{
+    return arena__alloc__region(arena, size, ARENA_DEFAULT_ALIGNMENT, NULL);
+}
+
+void*
+arena__alloc__aligned__unlocked(Arena *arena, size_t size, size_t align)
+{
+    return arena__alloc__region(arena, size, align, NULL);
+}
+
 
 void*
 arena_alloc(Arena *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_DEFAULT_ALIGNMENT);
+}
+
+void*
+arena_alloc_aligned(Arena *arena, size_t size, size_t align)
 {
     void *ptr;
     int ret;
 
     assert(arena != NULL);
-    assert(arena->head != NULL);
+    assert(arena->regions != NULL);
+    assert(ARENA_IS_POW2(align));
+
+    if(arena->tc_chunk != 0){
+        ptr = arena__tc__alloc(arena, size, align);
+        if(ptr != NULL)
+            return ptr;
+    }
+
+#ifdef ARENA_ATOMIC
+    /* Lock-free fast path, only falls through when the cursor region is full or a recycled
+       block of the size class is waiting. Heap mode regions are covered by TLSF blocks,
+       a bump would hand out their headers */
+    if(arena->heap == NULL && !arena__free__waiting(arena, size)){
+        ptr = arena__region__bump(atomic_load_explicit(&arena->curr, memory_order_acquire), size, align);
+        if(ptr != NULL)
+            return ptr;
+    }
+#endif /*ARENA_ATOMIC*/
 
     /* Locking the mutex */
     ret = pthread_mutex_lock(&arena->mutex);
     assert(ret == 0);
 
-    ptr = arena__alloc__unlocked(arena, size);
+    ptr = NULL;
+    if(arena->heap != NULL)
+        ptr = arena__heap__alloc(arena, size, align);
+    else if(align <= ARENA_DEFAULT_ALIGNMENT)
+        ptr = arena__free__get(arena, size);
+    if(ptr == NULL)
+        ptr = arena__alloc__aligned__unlocked(arena, size, align);
 
     /* Unlocking the mutex */
     ret = pthread_mutex_unlock(&arena->mutex);
@@ -206,227 +990,2743 @@ arena_alloc(Arena *arena, size_t size)
     return ptr;
 }
 
-size_t
-arena_strlen(const char *str)
+/* Keeps per-thread counters and similar hot data from sharing a cache line */
+void*
+arena_alloc_cacheline(Arena *arena, size_t size)
 {
-    size_t sz = 0;
-    while(*str){
-        sz++;
-        str++;
-    }
-    return sz;
+    return arena_alloc_aligned(arena, size, ARENA_CACHE_LINE_SIZE);
 }
 
-void *
-arena_memcpy(void *dest, const void *src, size_t n)
+void*
+arena_alloc_page(Arena *arena, size_t size)
 {
-    const char *_src = src;
-    char *_dest = dest;
-    for( ; n !=0; n--){
-        *_dest = *_src;
-        _dest++;
-        _src++;
-    }
-    return _dest;
+    return arena_alloc_aligned(arena, size, (size_t)ARENA_PAGE_SIZE);
 }
 
-#define arena_arr_append(arena, arr, item) \
-    do{ \
-        if((arr)->size >= (arr)->capacity) { \
-            size_t new_capacity = (arr)->capacity == 0 ? ARENA_ARR_INIT_CAPACITY : (arr)->capacity*2;  \
-            (arr)->items = arena_realloc(arena, \
-                                         (arr)->items, \
-                                         (arr)->capacity*sizeof(*(arr)->items), \
-                                         new_capacity*sizeof(*(arr)->items)); \
-            (arr)->capacity = new_capacity; \
-        } \
-        (arr)->items[(arr)->size] = item;\
-        (arr)->size++; \
-    } while(0)
-
-
-
-#define arena_str_append(a, str, ch) \
-    do { \
-        if ((str)->size + 2 > (str)->capacity) { /* +2 for char and null terminator */ \
-            size_t new_capacity = (str)->capacity ? (str)->capacity * 2 : ARENA_ARR_INIT_CAPACITY; \
-            (str)->items = arena_realloc((a), \
-                                        (str)->items, \
-                                        (str)->capacity * sizeof(char), \
-                                        new_capacity * sizeof(char)); \
-            (str)->capacity = new_capacity; \
-        } \
-        (str)->items[(str)->size] = (ch); \
-        (str)->size++; \
-        (str)->items[(str)->size] = '\0'; \
-    } while(0)
-
-#define arena_str_append_cstr(a, str, item) \
-    do { \
-        size_t len = arena_strlen(item); \
-        size_t new_size = (str)->size + len; \
-        if (new_size + 1 > (str)->capacity) { /* +1 for null terminator */ \
-            size_t new_capacity = (str)->capacity ? (str)->capacity * 2 : ARENA_ARR_INIT_CAPACITY; \
-            while (new_capacity < new_size + 1) new_capacity *= 2; \
-            (str)->items = arena_realloc((a), \
-                                        (str)->items, \
-                                        (str)->capacity * sizeof(char), \
-                                        new_capacity * sizeof(char)); \
-            (str)->capacity = new_capacity; \
-        } \
-        arena_memcpy((str)->items + (str)->size, (item), len); \
-        (str)->size = new_size; \
-        (str)->items[(str)->size] = '\0'; \
-    } while(0)
-
 /*
-    Memory in the arena allocator is managed in a linear fashion,
-    meaning previously allocated blocks cannot be individually freed or reused.
-    When reallocating, a new block is allocated, and the old block remains unused,
-    effectively making it "orphaned." This can lead to increased memory usage over time.
-
-    TODO: Find a better approach to handle reallocations
+    Pages past a region's dirty mark come straight from mmap or were dropped with MADV_DONTNEED,
+    so they already read as zero and only the part of a block below the mark is cleared. Blocks
+    from the heap, the realloc free lists or a thread cache chunk may hold anything, the first two
+    are cleared in full and thread caches are bypassed.
 */
-void *
-arena_realloc(Arena *arena, void *old_ptr, size_t old_size, size_t new_size)
+void*
+arena__alloc__zeroed(Arena *arena, size_t size, size_t align)
 {
-    unsigned char *new_ptr;
-    size_t i;
+    Region *region = NULL;
+    unsigned char *ptr;
+    size_t offset, dirty, clear = size;
     int ret;
-    assert(arena != NULL);
 
-    if(new_size < old_size)
-        return old_ptr;
+    assert(arena != NULL);
+    assert(arena->regions != NULL);
+    assert(ARENA_IS_POW2(align));
 
-    /* Locking the mutex */
     ret = pthread_mutex_lock(&arena->mutex);
     assert(ret == 0);
 
-    new_ptr = (unsigned char*)arena__alloc__unlocked(arena, new_size);
-
-    unsigned char * old_ptr_char = (unsigned char*)old_ptr;
-    for(i = 0; i < old_size; ++i){ /*Assuming no overlap happens*/
-        new_ptr[i] = old_ptr_char[i];
+    ptr = NULL;
+    if(arena->heap != NULL)
+        ptr = (unsigned char*)arena__heap__alloc(arena, size, align);
+    else if(align <= ARENA_DEFAULT_ALIGNMENT)
+        ptr = (unsigned char*)arena__free__get(arena, size);
+    if(ptr == NULL){
+        ptr = (unsigned char*)arena__alloc__region(arena, size, align, &region);
+        /* The mark is only lowered under the mutex, raising it concurrently is harmless */
+        offset = ptr - region->bytes;
+        dirty  = region->dirty;
+        clear  = offset < dirty ? dirty - offset : 0;
+        if(clear > size)
+            clear = size;
     }
 
-    /* Unlocking the mutex */
     ret = pthread_mutex_unlock(&arena->mutex);
     assert(ret == 0);
-    return (void*) new_ptr;
-}
 
+    if(region != NULL)
+        arena__zero__dirty(region, ptr, clear);
+    else
+        arena__zero(ptr, clear);
+    return ptr;
+}
 
+/* Clears n bytes of a block carved from region, large spans give their whole pages back instead */
 void
-arena_dump(Arena *arena)
+arena__zero__dirty(Region *region, unsigned char *ptr, size_t n)
 {
-    Region *curr;
-    size_t cnt = 0;
-
-    assert(arena != NULL);
-
-    printf("=============================\n");
-    for(curr = arena->head; curr != NULL; curr = curr->next ){
-        printf("===> Region %zu:\n", cnt);
-        arena__region__dump(curr);
-        cnt++;
+    size_t granularity;
+    unsigned char *start, *end;
+
+    /* hugetlb pages cannot be split, and the mapping must stay private anonymous memory */
+    if(n >= ARENA_ZERO_DONTNEED_THRESHOLD && !(region->flags & ARENA_REGION_HUGETLB)){
+        granularity = (region->flags & ARENA_REGION_THP) ? ARENA_HUGE_PAGE_SIZE : (size_t)ARENA_PAGE_SIZE;
+        start = (unsigned char*)(((uintptr_t)ptr + granularity - 1) & ~(uintptr_t)(granularity - 1));
+        end   = (unsigned char*)(((uintptr_t)ptr + n) & ~(uintptr_t)(granularity - 1));
+        if(start < end && madvise(start, end - start, MADV_DONTNEED) == 0){
+            arena__zero(ptr, start - ptr);
+            arena__zero(end, ptr + n - end);
+            return;
+        }
     }
-    printf("=============================\n");
-    printf("\n");
+    arena__zero(ptr, n);
 }
 
 void
-arena_reset(Arena *arena){
-    Region *curr;
-    int ret;
-    assert(arena != NULL);
-
-    for(curr = arena->head; curr != NULL; curr = curr->next){
-        curr->count = 0;
-        curr->remaining = curr->capacity;
+arena__zero(void *ptr, size_t n)
+{
+#ifdef ARENA_USE_LIBC
+    memset(ptr, 0, n);
+#else
+    unsigned char *p = (unsigned char*)ptr;
+
+    for( ; n != 0 && ((uintptr_t)p & (sizeof(size_t) - 1)) != 0; n--)
+        *p++ = 0;
+    for( ; n >= sizeof(size_t); n -= sizeof(size_t)){
+        *(size_t*)p = 0;
+        p += sizeof(size_t);
     }
-
-    /* Safe to destroy - no other threads should be using it */
-    ret = pthread_mutex_destroy(&arena->mutex);
-    assert(ret == 0);
-
-    /* Re-initialize the mutex for future use */
-    ret = pthread_mutex_init(&arena->mutex, NULL);
-    assert(ret == 0);
+    for( ; n != 0; n--)
+        *p++ = 0;
+#endif /*ARENA_USE_LIBC*/
 }
 
-void
-arena_destroy(Arena *arena)
+void*
+arena_alloc_zeroed(Arena *arena, size_t size)
 {
-    Region* curr, *temp;
-    int ret;
+    return arena__alloc__zeroed(arena, size, ARENA_DEFAULT_ALIGNMENT);
+}
 
-    for(curr = arena->head; curr != NULL;){
-        temp = curr;
-        curr = curr->next;
-        arena__free__region(temp);
+void*
+arena_calloc(Arena *arena, size_t n, size_t size)
+{
+    if(size != 0 && n > (size_t)-1 / size){
+        assert(!"arena_calloc size overflows");
+        return NULL;
     }
-    arena->head = NULL;
-    arena->tail = NULL;
-
-    /* Safe to destroy - no other threads should be using it */
-    ret = pthread_mutex_destroy(&arena->mutex);
-    assert(ret == 0);
+    return arena__alloc__zeroed(arena, n * size, ARENA_DEFAULT_ALIGNMENT);
 }
 
-Region*
-arena__new__region(size_t size)
+/* Size of a batch slot, keeps every block of a batch at the default alignment.
+   Wraps to less than size when the rounding overflows */
+size_t
+arena__batch__stride(size_t size)
 {
-    Region *region;
-    void *ptr;
-
-    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    assert(ptr != MAP_FAILED);
+    return (size + ARENA_DEFAULT_ALIGNMENT - 1) & ~((size_t)ARENA_DEFAULT_ALIGNMENT - 1);
+}
 
-    region             = (Region*) ptr;
-    region->next       = NULL;
-    region->capacity   = size - ARENA_REGION_SIZE;
-    region->remaining  = size - ARENA_REGION_SIZE;
-    region->count      = 0;
-    region->bytes      = ((unsigned char*)ptr) + ARENA_REGION_SIZE;
+/* A batch whose size overflows gets no blocks at all rather than short ones */
+int
+arena__batch__fail(void **out, size_t n)
+{
+    size_t i;
 
-    return region;
+    assert(!"batch size overflows");
+    for(i = 0; i < n; ++i)
+        out[i] = NULL;
+    return 0;
 }
 
+/* Heap mode blocks must be freeable one by one, so they cannot share a bump */
 void
-arena__append__region(Arena *arena, size_t size)
+arena__batch__heap(Arena *arena, const size_t *sizes, size_t size, void **out, size_t n)
 {
-    Region *region;
-    if(size < (size_t)ARENA_REGION_DEFAULT_CAPACITY){
-        size = ARENA_REGION_DEFAULT_CAPACITY;
-    } else{
-        size = arena__align__size(size);
-    }
-    region = arena__new__region(size);
-    arena->tail->next = region;
-    arena->tail = region;
+    size_t i;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    for(i = 0; i < n; ++i)
+        out[i] = arena__heap__alloc(arena, sizes != NULL ? sizes[i] : size, ARENA_DEFAULT_ALIGNMENT);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+/* One allocation of the summed sizes, so the mutex is taken at most once for the whole batch */
+int
+arena_alloc_batch(Arena *arena, const size_t *sizes, void **out, size_t n)
+{
+    unsigned char *base;
+    size_t i, stride, total = 0;
+
+    assert(arena != NULL);
+    assert(n == 0 || (sizes != NULL && out != NULL));
+
+    if(arena->heap != NULL){
+        arena__batch__heap(arena, sizes, 0, out, n);
+        return 1;
+    }
+
+    for(i = 0; i < n; ++i){
+        stride = arena__batch__stride(sizes[i]);
+        if(stride < sizes[i] || total + stride < total)
+            return arena__batch__fail(out, n);
+        total += stride;
+    }
+    base = (unsigned char*)arena_alloc(arena, total);
+    for(i = 0; i < n; ++i){
+        out[i] = base;
+        base += arena__batch__stride(sizes[i]);
+    }
+    return 1;
+}
+
+int
+arena_alloc_n(Arena *arena, size_t size, size_t count, void **out)
+{
+    unsigned char *base;
+    size_t i, stride;
+
+    assert(arena != NULL);
+    assert(count == 0 || out != NULL);
+
+    if(arena->heap != NULL){
+        arena__batch__heap(arena, NULL, size, out, count);
+        return 1;
+    }
+
+    stride = arena__batch__stride(size);
+    if(stride < size || (count != 0 && stride > (size_t)-1 / count))
+        return arena__batch__fail(out, count);
+    base = (unsigned char*)arena_alloc(arena, stride * count);
+    for(i = 0; i < count; ++i)
+        out[i] = base + i * stride;
+    return 1;
+}
+
+void
+arena_thread_cache_enable(Arena *arena, size_t chunk_size)
+{
+    assert(arena != NULL);
+    assert(arena->heap == NULL && "heap mode blocks are not carved from chunks");
+    if(chunk_size == 0)
+        chunk_size = ARENA_THREAD_CACHE_CHUNK;
+    arena->tc_chunk = chunk_size;
+}
+
+/*
+    Per-thread caches: each thread owns ARENA_THREAD_CACHE_SLOTS slots, every slot holds
+    a chunk of one arena. Allocating from a slot is a plain bump with no locking, the arena
+    mutex is only taken to carve a new chunk or to hand a chunk back.
+
+    Every slot holding a chunk is linked into its arena's tc_list so that arena_reset and
+    arena_destroy can invalidate it, the pthread key destructor hands the chunks back
+    when the thread exits.
+*/
+static ARENA_THREAD_LOCAL ArenaThreadCache arena__tc[ARENA_THREAD_CACHE_SLOTS];
+static ARENA_THREAD_LOCAL size_t arena__tc__victim;
+static ARENA_THREAD_LOCAL Arena arena__scratch[ARENA_SCRATCH_COUNT];
+static pthread_key_t arena__thread__key;
+static pthread_once_t arena__thread__once = PTHREAD_ONCE_INIT;
+
+static void
+arena__thread__key__init(void)
+{
+    int ret = pthread_key_create(&arena__thread__key, arena__thread__exit);
+    assert(ret == 0);
+}
+
+/* Makes sure arena__thread__exit runs when the calling thread exits */
+void
+arena__thread__register(void)
+{
+    int ret;
+
+    ret = pthread_once(&arena__thread__once, arena__thread__key__init);
+    assert(ret == 0);
+    if(pthread_getspecific(arena__thread__key) == NULL){
+        ret = pthread_setspecific(arena__thread__key, arena__tc);
+        assert(ret == 0);
+    }
+}
+
+/* Hands back the thread's cached chunks and destroys its scratch arenas */
+void
+arena__thread__exit(void *unused)
+{
+    size_t i;
+
+    (void)unused;
+    arena__tc__thread__exit(arena__tc);
+    for(i = 0; i < ARENA_SCRATCH_COUNT; ++i){
+        if(arena__scratch[i].regions != NULL)
+            arena_destroy(&arena__scratch[i]);
+    }
+}
+
+/* Must be called with tc->arena->mutex held */
+void
+arena__tc__release(ArenaThreadCache *tc)
+{
+    Region *region = tc->region;
+
+    /* The unused tail goes back to the region only if nothing was bumped after the chunk */
+    if(region != NULL)
+        arena__region__move(region,
+                            (size_t)(tc->end - region->bytes),
+                            (size_t)(tc->cur - region->bytes));
+
+    if(tc->prev != NULL)
+        tc->prev->next = tc->next;
+    else
+        tc->arena->tc_list = tc->next;
+    if(tc->next != NULL)
+        tc->next->prev = tc->prev;
+
+    tc->arena  = NULL;
+    tc->region = NULL;
+    tc->cur    = NULL;
+    tc->end    = NULL;
+    tc->next   = NULL;
+    tc->prev   = NULL;
+}
+
+/*
+    Invalidates every thread cache of the arena, called from arena_reset and arena_destroy.
+    This writes the cache slots of other threads without any synchronization on their side,
+    so no other thread holding a chunk of the arena may make any arena call meanwhile, even
+    one on a different arena, because it scans all of its slots
+*/
+void
+arena__tc__drop__all(Arena *arena)
+{
+    ArenaThreadCache *tc, *next;
+
+    for(tc = arena->tc_list; tc != NULL; tc = next){
+        next = tc->next;
+        tc->arena  = NULL;
+        tc->region = NULL;
+        tc->cur    = NULL;
+        tc->end    = NULL;
+        tc->next   = NULL;
+        tc->prev   = NULL;
+    }
+    arena->tc_list = NULL;
+}
+
+void
+arena__tc__thread__exit(void *slots)
+{
+    ArenaThreadCache *tc = (ArenaThreadCache*)slots;
+    Arena *arena;
+    size_t i;
+    int ret;
+
+    for(i = 0; i < ARENA_THREAD_CACHE_SLOTS; ++i){
+        arena = tc[i].arena;
+        if(arena == NULL)
+            continue;
+
+        ret = pthread_mutex_lock(&arena->mutex);
+        assert(ret == 0);
+        arena__tc__release(&tc[i]);
+        ret = pthread_mutex_unlock(&arena->mutex);
+        assert(ret == 0);
+    }
+}
+
+/* Returns the calling thread's slot for the arena, evicting another arena's chunk if all slots are taken */
+ArenaThreadCache*
+arena__tc__slot(Arena *arena)
+{
+    ArenaThreadCache *tc, *empty = NULL;
+    Arena *victim;
+    size_t i;
+    int ret;
+
+    for(i = 0; i < ARENA_THREAD_CACHE_SLOTS; ++i){
+        if(arena__tc[i].arena == arena)
+            return &arena__tc[i];
+        if(empty == NULL && arena__tc[i].arena == NULL)
+            empty = &arena__tc[i];
+    }
+
+    if(empty != NULL)
+        return empty;
+
+    tc = &arena__tc[arena__tc__victim];
+    arena__tc__victim = (arena__tc__victim + 1) % ARENA_THREAD_CACHE_SLOTS;
+
+    /* arena__tc__release clears tc->arena */
+    victim = tc->arena;
+    ret = pthread_mutex_lock(&victim->mutex);
+    assert(ret == 0);
+    arena__tc__release(tc);
+    ret = pthread_mutex_unlock(&victim->mutex);
+    assert(ret == 0);
+
+    return tc;
+}
+
+/* Returns NULL when the request is too large to be served from a thread cache */
+void*
+arena__tc__alloc(Arena *arena, size_t size, size_t align)
+{
+    ArenaThreadCache *tc;
+    size_t pad;
+    void *ptr;
+    int ret;
+
+    if(size > arena->tc_chunk / 2 || align > arena->tc_chunk / 2)
+        return NULL;
+
+    tc = arena__tc__slot(arena);
+    if(tc->arena == arena){
+        pad = -(uintptr_t)tc->cur & (align - 1);
+        if(pad <= (size_t)(tc->end - tc->cur) && size <= (size_t)(tc->end - tc->cur) - pad){
+            ptr = tc->cur + pad;
+            tc->cur += pad + size;
+            return ptr;
+        }
+    }
+
+    /* Slow path: hand back what is left and carve a fresh chunk under the lock */
+    arena__thread__register();
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    if(tc->arena == arena)
+        arena__tc__release(tc);
+
+    tc->cur    = arena__alloc__region(arena, arena->tc_chunk, align, &tc->region);
+    tc->end    = tc->cur + arena->tc_chunk;
+
+    tc->arena = arena;
+    tc->prev  = NULL;
+    tc->next  = arena->tc_list;
+    if(arena->tc_list != NULL)
+        arena->tc_list->prev = tc;
+    arena->tc_list = tc;
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+
+    ptr = tc->cur;
+    tc->cur += size;
+    return ptr;
+}
+
+#ifdef ARENA_USE_LIBC
+
+size_t
+arena_strlen(const char *str)
+{
+    return strlen(str);
+}
+
+void *
+arena_memcpy(void *dest, const void *src, size_t n)
+{
+    return memcpy(dest, src, n);
+}
+
+#else
+
+/*
+    Without libc the copies are done a word at a time, and on x86 with SSE2 or AVX2 picked
+    once at startup from CPUID. Copies of ARENA_MEMCPY_STREAM_THRESHOLD bytes or more use
+    non-temporal stores so that a multi-megabyte realloc does not evict the whole cache.
+    arena_strlen reads whole aligned words or vectors, which may run past the terminator but
+    never into the next page, so it is hidden from AddressSanitizer.
+*/
+typedef size_t __attribute__((__may_alias__, __aligned__(1))) ArenaUnalignedWord;
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ARENA_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#endif
+#endif
+#if !defined(ARENA_NO_SANITIZE_ADDRESS) && defined(__SANITIZE_ADDRESS__)
+#define ARENA_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#endif
+#ifndef ARENA_NO_SANITIZE_ADDRESS
+#define ARENA_NO_SANITIZE_ADDRESS
+#endif
+
+void*
+arena__memcpy__word(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    for( ; n >= 4 * sizeof(size_t); n -= 4 * sizeof(size_t)){
+        ((ArenaUnalignedWord*)d)[0] = ((const ArenaUnalignedWord*)s)[0];
+        ((ArenaUnalignedWord*)d)[1] = ((const ArenaUnalignedWord*)s)[1];
+        ((ArenaUnalignedWord*)d)[2] = ((const ArenaUnalignedWord*)s)[2];
+        ((ArenaUnalignedWord*)d)[3] = ((const ArenaUnalignedWord*)s)[3];
+        d += 4 * sizeof(size_t);
+        s += 4 * sizeof(size_t);
+    }
+    for( ; n >= sizeof(size_t); n -= sizeof(size_t)){
+        *(ArenaUnalignedWord*)d = *(const ArenaUnalignedWord*)s;
+        d += sizeof(size_t);
+        s += sizeof(size_t);
+    }
+    for( ; n != 0; n--)
+        *d++ = *s++;
+    return dest;
+}
+
+ARENA_NO_SANITIZE_ADDRESS size_t
+arena__strlen__word(const char *str)
+{
+    const char *p = str;
+    const size_t ones = (size_t)-1 / 0xff, highs = ones << 7;
+    size_t word;
+
+    for( ; ((uintptr_t)p & (sizeof(size_t) - 1)) != 0; p++)
+        if(*p == '\0')
+            return (size_t)(p - str);
+
+    /* A word has a zero byte iff (word - 0x01..01) & ~word & 0x80..80 is non-zero */
+    for(;;){
+        word = *(const ArenaUnalignedWord*)p;
+        if(((word - ones) & ~word & highs) != 0)
+            break;
+        p += sizeof(size_t);
+    }
+    while(*p != '\0')
+        p++;
+    return (size_t)(p - str);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(ARENA_NO_SIMD)
+#define ARENA_SIMD_X86
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) void*
+arena__memcpy__sse2(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+    __m128i a, b, c, e;
+    size_t head;
+
+    if(n >= ARENA_MEMCPY_STREAM_THRESHOLD){
+        /* Streaming stores need an aligned destination */
+        head = -(uintptr_t)d & 15;
+        arena__memcpy__word(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+        for( ; n >= 64; n -= 64, d += 64, s += 64){
+            a = _mm_loadu_si128((const __m128i*)s);
+            b = _mm_loadu_si128((const __m128i*)(s + 16));
+            c = _mm_loadu_si128((const __m128i*)(s + 32));
+            e = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_stream_si128((__m128i*)d, a);
+            _mm_stream_si128((__m128i*)(d + 16), b);
+            _mm_stream_si128((__m128i*)(d + 32), c);
+            _mm_stream_si128((__m128i*)(d + 48), e);
+        }
+        _mm_sfence();
+    }
+    for( ; n >= 64; n -= 64, d += 64, s += 64){
+        a = _mm_loadu_si128((const __m128i*)s);
+        b = _mm_loadu_si128((const __m128i*)(s + 16));
+        c = _mm_loadu_si128((const __m128i*)(s + 32));
+        e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_storeu_si128((__m128i*)d, a);
+        _mm_storeu_si128((__m128i*)(d + 16), b);
+        _mm_storeu_si128((__m128i*)(d + 32), c);
+        _mm_storeu_si128((__m128i*)(d + 48), e);
+    }
+    for( ; n >= 16; n -= 16, d += 16, s += 16)
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    arena__memcpy__word(d, s, n);
+    return dest;
+}
+
+__attribute__((target("avx2"))) void*
+arena__memcpy__avx2(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+    __m256i a, b, c, e;
+    size_t head;
+
+    if(n >= ARENA_MEMCPY_STREAM_THRESHOLD){
+        head = -(uintptr_t)d & 31;
+        arena__memcpy__word(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+        for( ; n >= 128; n -= 128, d += 128, s += 128){
+            a = _mm256_loadu_si256((const __m256i*)s);
+            b = _mm256_loadu_si256((const __m256i*)(s + 32));
+            c = _mm256_loadu_si256((const __m256i*)(s + 64));
+            e = _mm256_loadu_si256((const __m256i*)(s + 96));
+            _mm256_stream_si256((__m256i*)d, a);
+            _mm256_stream_si256((__m256i*)(d + 32), b);
+            _mm256_stream_si256((__m256i*)(d + 64), c);
+            _mm256_stream_si256((__m256i*)(d + 96), e);
+        }
+        _mm_sfence();
+    }
+    for( ; n >= 128; n -= 128, d += 128, s += 128){
+        a = _mm256_loadu_si256((const __m256i*)s);
+        b = _mm256_loadu_si256((const __m256i*)(s + 32));
+        c = _mm256_loadu_si256((const __m256i*)(s + 64));
+        e = _mm256_loadu_si256((const __m256i*)(s + 96));
+        _mm256_storeu_si256((__m256i*)d, a);
+        _mm256_storeu_si256((__m256i*)(d + 32), b);
+        _mm256_storeu_si256((__m256i*)(d + 64), c);
+        _mm256_storeu_si256((__m256i*)(d + 96), e);
+    }
+    for( ; n >= 32; n -= 32, d += 32, s += 32)
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+    arena__memcpy__word(d, s, n);
+    return dest;
+}
+
+/* Aligned loads never cross into a page the string does not reach */
+__attribute__((target("sse2"))) ARENA_NO_SANITIZE_ADDRESS size_t
+arena__strlen__sse2(const char *str)
+{
+    const char *p = (const char*)((uintptr_t)str & ~(uintptr_t)15);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned mask;
+
+    mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+    mask >>= (unsigned)(str - p);
+    if(mask != 0)
+        return (size_t)__builtin_ctz(mask);
+    for(;;){
+        p += 16;
+        mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+        if(mask != 0)
+            return (size_t)(p - str) + (size_t)__builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2"))) ARENA_NO_SANITIZE_ADDRESS size_t
+arena__strlen__avx2(const char *str)
+{
+    const char *p = (const char*)((uintptr_t)str & ~(uintptr_t)31);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned mask;
+
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+    mask >>= (unsigned)(str - p);
+    if(mask != 0)
+        return (size_t)__builtin_ctz(mask);
+    for(;;){
+        p += 32;
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+        if(mask != 0)
+            return (size_t)(p - str) + (size_t)__builtin_ctz(mask);
+    }
+}
+#endif /*ARENA_SIMD_X86*/
+
+static void *(*arena__memcpy__impl)(void *dest, const void *src, size_t n) = arena__memcpy__word;
+static size_t (*arena__strlen__impl)(const char *str) = arena__strlen__word;
+
+/* Runs before main, so the pointers never change while other threads read them */
+__attribute__((constructor)) void
+arena__simd__select(void)
+{
+#ifdef ARENA_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        arena__memcpy__impl = arena__memcpy__avx2;
+        arena__strlen__impl = arena__strlen__avx2;
+    } else if(__builtin_cpu_supports("sse2")){
+        arena__memcpy__impl = arena__memcpy__sse2;
+        arena__strlen__impl = arena__strlen__sse2;
+    }
+#endif /*ARENA_SIMD_X86*/
+}
+
+size_t
+arena_strlen(const char *str)
+{
+    return arena__strlen__impl(str);
+}
+
+void *
+arena_memcpy(void *dest, const void *src, size_t n)
+{
+    return arena__memcpy__impl(dest, src, n);
+}
+
+#endif /*ARENA_USE_LIBC*/
+
+#define arena_arr_append(arena, arr, item) \
+    do{ \
+        if((arr)->size >= (arr)->capacity) { \
+            size_t new_capacity = (arr)->capacity == 0 ? ARENA_ARR_INIT_CAPACITY : (arr)->capacity*2;  \
+            (arr)->items = arena_realloc(arena, \
+                                         (arr)->items, \
+                                         (arr)->capacity*sizeof(*(arr)->items), \
+                                         new_capacity*sizeof(*(arr)->items)); \
+            (arr)->capacity = new_capacity; \
+        } \
+        (arr)->items[(arr)->size] = item;\
+        (arr)->size++; \
+    } while(0)
+
+
+
+#define arena_str_append(a, str, ch) \
+    do { \
+        if ((str)->size + 2 > (str)->capacity) { /* +2 for char and null terminator */ \
+            size_t new_capacity = (str)->capacity ? (str)->capacity * 2 : ARENA_ARR_INIT_CAPACITY; \
+            (str)->items = arena_realloc((a), \
+                                        (str)->items, \
+                                        (str)->capacity * sizeof(char), \
+                                        new_capacity * sizeof(char)); \
+            (str)->capacity = new_capacity; \
+        } \
+        (str)->items[(str)->size] = (ch); \
+        (str)->size++; \
+        (str)->items[(str)->size] = '\0'; \
+    } while(0)
+
+#define arena_str_append_cstr(a, str, item) \
+    do { \
+        size_t len = arena_strlen(item); \
+        size_t new_size = (str)->size + len; \
+        if (new_size + 1 > (str)->capacity) { /* +1 for null terminator */ \
+            size_t new_capacity = (str)->capacity ? (str)->capacity * 2 : ARENA_ARR_INIT_CAPACITY; \
+            while (new_capacity < new_size + 1) new_capacity *= 2; \
+            (str)->items = arena_realloc((a), \
+                                        (str)->items, \
+                                        (str)->capacity * sizeof(char), \
+                                        new_capacity * sizeof(char)); \
+            (str)->capacity = new_capacity; \
+        } \
+        arena_memcpy((str)->items + (str)->size, (item), len); \
+        (str)->size = new_size; \
+        (str)->items[(str)->size] = '\0'; \
+    } while(0)
+
+/*
+    Memory in the arena allocator is managed in a linear fashion,
+    meaning previously allocated blocks cannot be individually freed or reused.
+    If the block is the most recent allocation of the cursor region (or of the calling
+    thread's cache) it is grown or shrunk in place, which is the common case for
+    arena_arr_append and arena_str_append*. Otherwise a new block is allocated and the
+    old block is "orphaned", it goes on the arena's size-class free lists where a later
+    arena_alloc or arena_realloc of its class picks it up before bumping. The free lists
+    are dropped by arena_reset and arena_rewind.
+    Heap mode arenas resize through the TLSF heap instead, growing into a free neighbour
+    when there is one, and old_size is not needed.
+*/
+void *
+arena_realloc(Arena *arena, void *old_ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr;
+    int ret;
+    assert(arena != NULL);
+
+    if(old_ptr == NULL)
+        return arena_alloc(arena, new_size);
+
+    if(arena->heap != NULL){
+        ret = pthread_mutex_lock(&arena->mutex);
+        assert(ret == 0);
+        new_ptr = arena__heap__realloc(arena, old_ptr, new_size);
+        ret = pthread_mutex_unlock(&arena->mutex);
+        assert(ret == 0);
+        return new_ptr;
+    }
+
+    if(arena__resize__in__place(arena, old_ptr, old_size, new_size))
+        return old_ptr;
+
+    if(new_size < old_size)
+        return old_ptr;
+
+    /* The old block belongs to the caller, so only the allocation itself needs the lock */
+    new_ptr = arena_alloc(arena, new_size);
+    arena_memcpy(new_ptr, old_ptr, old_size); /*Assuming no overlap happens*/
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    arena__free__put(arena, old_ptr, old_size);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+
+    return new_ptr;
+}
+
+void
+arena_free(Arena *arena, void *ptr)
+{
+    int ret;
+    assert(arena != NULL);
+
+    if(ptr == NULL || arena->heap == NULL)
+        return;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    arena__heap__free(arena->heap, ptr);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+
+/* Moves the end of the block if nothing was allocated after it, returns 0 when the block has to move */
+int
+arena__resize__in__place(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    unsigned char *p = (unsigned char*)ptr;
+    Region *region;
+    size_t i;
+    int ok = 0, ret;
+
+    if(arena->tc_chunk != 0){
+        for(i = 0; i < ARENA_THREAD_CACHE_SLOTS; ++i){
+            if(arena__tc[i].arena != arena || p + old_size != arena__tc[i].cur)
+                continue;
+            if(new_size > (size_t)(arena__tc[i].end - p))
+                return 0;
+            arena__tc[i].cur = p + new_size;
+            return 1;
+        }
+    }
+
+#ifdef ARENA_ATOMIC
+    /* The CAS in arena__region__move fails if another thread bumped the region meanwhile */
+    region = atomic_load_explicit(&arena->curr, memory_order_acquire);
+#else
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    region = arena->curr;
+#endif /*ARENA_ATOMIC*/
+
+    if((uintptr_t)p >= (uintptr_t)region->bytes &&
+       (uintptr_t)p - (uintptr_t)region->bytes <= region->capacity){
+        ok = arena__region__move(region,
+                                 (size_t)(p - region->bytes) + old_size,
+                                 (size_t)(p - region->bytes) + new_size);
+#ifndef ARENA_ATOMIC
+        /* In reserve mode the block may grow into memory that is not committed yet */
+        if(!ok && region->count == (size_t)(p - region->bytes) + old_size && new_size > old_size &&
+           arena__region__commit(region, new_size - old_size)){
+            ok = arena__region__move(region,
+                                     (size_t)(p - region->bytes) + old_size,
+                                     (size_t)(p - region->bytes) + new_size);
+        }
+#endif /*ARENA_ATOMIC*/
+    }
+
+#ifndef ARENA_ATOMIC
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+#else
+    (void)ret;
+#endif /*ARENA_ATOMIC*/
+    return ok;
+}
+
+
+void
+arena_dump(Arena *arena)
+{
+    Region *curr;
+    size_t cnt = 0;
+
+    assert(arena != NULL);
+
+    printf("=============================\n");
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr){
+        printf("===> Region %zu:\n", cnt);
+        arena__region__dump(curr);
+        cnt++;
+    }
+    printf("=============================\n");
+    printf("\n");
+}
+
+void
+arena_stats(Arena *arena, ArenaStats *stats)
+{
+    Region *curr;
+    int ret;
+
+    assert(arena != NULL);
+    assert(stats != NULL);
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    *stats = (ArenaStats){0};
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr){
+        stats->regions++;
+        stats->capacity += curr->capacity;
+        stats->committed += curr->committed;
+        stats->used     += curr->count;
+        if(curr->flags & ARENA_REGION_HUGETLB)
+            stats->hugetlb_bytes += curr->capacity;
+        if(curr->flags & ARENA_REGION_THP)
+            stats->thp_bytes += curr->capacity;
+    }
+    if(arena->heap != NULL)
+        stats->used = arena->heap->used;
+    stats->free_bytes     = arena->free_bytes;
+    stats->recycled_bytes = arena->recycled_bytes;
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+void
+arena_reset(Arena *arena){
+    Region *curr;
+    uint64_t now;
+    int ret;
+    assert(arena != NULL);
+
+    /* Only the purge thread can race with us here */
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    now = arena__now__ms();
+    arena__tc__drop__all(arena);
+    if(arena->config.growth == ARENA_GROWTH_ADAPTIVE && arena->config.reserve == 0)
+        arena__adapt(arena);
+    if(arena->config.release != ARENA_RELEASE_NONE)
+        arena__retain(arena);
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr){
+        arena__region__lower(curr, 0, now);
+        if(arena->config.decommit_watermark != 0)
+            arena__region__decommit(curr, arena->config.decommit_watermark);
+    }
+    arena->curr = arena->regions;
+    arena__lookback__clear(arena);
+    arena__free__clear(arena);
+    if(arena->heap != NULL)
+        arena__heap__reset(arena);
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+ArenaMark
+arena_mark(Arena *arena)
+{
+    ArenaMark mark;
+    int ret;
+    assert(arena != NULL);
+    assert(arena->heap == NULL && "heap mode arenas cannot be rewound");
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    mark.region = arena->curr;
+    mark.count  = arena->curr->count;
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+    return mark;
+}
+
+/* Empties the regions between the mark and the cursor, returns the last one it emptied or NULL */
+Region*
+arena__rewind(Arena *arena, ArenaMark mark)
+{
+    Region *curr, *last = NULL;
+    uint64_t now;
+
+    assert(arena != NULL);
+    assert(mark.region != NULL);
+
+    /* Chunks carved after the mark would alias new allocations */
+    arena__tc__drop__all(arena);
+
+    now = arena__now__ms();
+    for(curr = mark.region + 1; curr <= arena->curr; ++curr){
+        arena__region__lower(curr, 0, now);
+        last = curr;
+    }
+    arena__region__lower(mark.region, mark.count, now);
+    arena->curr = mark.region;
+
+    /* The look-back ring may point past the cursor now, and so may the free lists */
+    arena__lookback__clear(arena);
+    arena__free__clear(arena);
+    return last;
+}
+
+void
+arena_rewind(Arena *arena, ArenaMark mark)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    arena__rewind(arena, mark);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+void
+arena_rewind_trim(Arena *arena, ArenaMark mark)
+{
+    Region *curr, *last, *end;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    last = arena__rewind(arena, mark);
+    if(last != NULL){
+        /* Last first, like arena__retain */
+        for(curr = last; curr > mark.region; --curr)
+            arena__free__region(arena, curr);
+
+        /* Close the gap, nothing may point past the mark once it is rewound */
+        end = arena->regions + arena->nregions;
+        for(curr = last + 1; curr < end; ++curr)
+            mark.region[1 + (curr - last - 1)] = *curr;
+        arena->nregions -= (size_t)(last - mark.region);
+    }
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+/* arena_push blocks are preceded by the region they were bumped from and their end offset */
+typedef struct{
+    Region *region;
+    size_t end;
+} ArenaPushHeader;
+
+/* The header needs its own alignment even when ARENA_DEFAULT_ALIGNMENT is defined as 1 */
+#define ARENA_PUSH_ALIGN        (ARENA_DEFAULT_ALIGNMENT > _Alignof(ArenaPushHeader) ? (size_t)ARENA_DEFAULT_ALIGNMENT : _Alignof(ArenaPushHeader))
+#define ARENA_PUSH_HEADER       ((sizeof(ArenaPushHeader) + ARENA_PUSH_ALIGN - 1) & ~(ARENA_PUSH_ALIGN - 1))
+
+void*
+arena_push(Arena *arena, size_t size)
+{
+    ArenaPushHeader *header;
+    Region *region;
+    int ret;
+
+    assert(arena != NULL);
+    assert(arena->heap == NULL && "heap mode arenas use arena_free instead");
+    assert(size <= (size_t)-1 - ARENA_PUSH_HEADER - ARENA_PUSH_ALIGN && "arena_push size overflows");
+
+    /* Keeps count aligned, so a popped block hands back exactly what the next push needs */
+    size = (size + ARENA_PUSH_ALIGN - 1) & ~(ARENA_PUSH_ALIGN - 1);
+
+    /* Bypasses the thread cache and the free lists, the block must come from a known region */
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    header = (ArenaPushHeader*)arena__alloc__region(arena, ARENA_PUSH_HEADER + size, ARENA_PUSH_ALIGN, &region);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+
+    header->region = region;
+    header->end    = (size_t)((unsigned char*)header - region->bytes) + ARENA_PUSH_HEADER + size;
+    return (unsigned char*)header + ARENA_PUSH_HEADER;
+}
+
+/* Rolls the region's count back to where the header starts, only padding left by a plain
+   allocation before the first push stays in place */
+void
+arena_pop(Arena *arena, void *ptr)
+{
+    ArenaPushHeader *header;
+    Region *region;
+    int ret;
+
+    assert(arena != NULL);
+    if(ptr == NULL)
+        return;
+    header = (ArenaPushHeader*)((unsigned char*)ptr - ARENA_PUSH_HEADER);
+    region = header->region;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+    /* The cursor follows the stack back over the regions it emptied, otherwise a stack that
+       keeps crossing a region boundary would map a new region every time */
+    if(arena__region__move(region, header->end, (size_t)((unsigned char*)header - region->bytes)))
+        arena__curr__retreat(arena, region);
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+}
+
+ArenaScratch
+arena_scratch_begin(Arena **conflicts, size_t n)
+{
+    ArenaScratch scratch;
+    Arena *candidate;
+    size_t i, j;
+
+    for(i = 0; i < ARENA_SCRATCH_COUNT; ++i){
+        candidate = &arena__scratch[i];
+        for(j = 0; j < n; ++j){
+            if(conflicts[j] == candidate)
+                break;
+        }
+        if(j < n)
+            continue;
+
+        /* Created lazily, the thread exit hook destroys it */
+        if(candidate->regions == NULL){
+            arena_init(candidate, ARENA_SCRATCH_CAPACITY);
+            arena__thread__register();
+        }
+
+        scratch.arena = candidate;
+        scratch.mark  = arena_mark(candidate);
+        return scratch;
+    }
+
+    assert(0 && "every scratch arena conflicts, raise ARENA_SCRATCH_COUNT");
+    scratch.arena = NULL;
+    return scratch;
+}
+
+void
+arena_scratch_end(ArenaScratch scratch)
+{
+    assert(scratch.arena != NULL);
+    arena_rewind(scratch.arena, scratch.mark);
+}
+
+void
+arena_frame_init(ArenaFrame *frame, size_t count, size_t size)
+{
+    size_t i;
+
+    assert(frame != NULL);
+    assert(count >= 2 && count <= ARENA_FRAME_MAX_ARENAS && "raise ARENA_FRAME_MAX_ARENAS");
+    for(i = 0; i < count; ++i)
+        arena_init(&frame->arenas[i], size);
+    frame->count   = count;
+    frame->current = 0;
+}
+
+/* The arena being entered is the one that served frame N + 1 - count, nothing can still use it */
+Arena*
+arena_frame_advance(ArenaFrame *frame)
+{
+    assert(frame != NULL && frame->count != 0);
+    frame->current = (frame->current + 1) % frame->count;
+    arena_reset(&frame->arenas[frame->current]);
+    return &frame->arenas[frame->current];
+}
+
+Arena*
+arena_frame_current(ArenaFrame *frame)
+{
+    assert(frame != NULL && frame->count != 0);
+    return &frame->arenas[frame->current];
+}
+
+Arena*
+arena_frame_previous(ArenaFrame *frame)
+{
+    assert(frame != NULL && frame->count != 0);
+    return &frame->arenas[(frame->current + frame->count - 1) % frame->count];
+}
+
+void
+arena_frame_destroy(ArenaFrame *frame)
+{
+    size_t i;
+
+    assert(frame != NULL);
+    for(i = 0; i < frame->count; ++i)
+        arena_destroy(&frame->arenas[i]);
+    frame->count   = 0;
+    frame->current = 0;
+}
+
+/*
+    Ring arenas. The ring is a memfd mapped twice in a row, so a block that starts near the end
+    of the ring simply runs on into the second mapping, which shows the start of the ring again.
+    Without memfd_create, the ring is a plain region, and a block that does not fit before the
+    end is placed at the start. The skipped tail is filled with a released dummy block.
+*/
+/* At least a word, so that headers stay aligned and block sizes keep their low bit free */
+#define ARENA_RING_ALIGN        (ARENA_DEFAULT_ALIGNMENT > sizeof(size_t) ? (size_t)ARENA_DEFAULT_ALIGNMENT : sizeof(size_t))
+#define ARENA_RING_HEADER       ((sizeof(size_t) + ARENA_RING_ALIGN - 1) & ~(ARENA_RING_ALIGN - 1))
+#define ARENA_RING_RELEASED     ((size_t)1)
+
+#ifndef ARENA_MFD_CLOEXEC
+#define ARENA_MFD_CLOEXEC       1u
+#endif /*ARENA_MFD_CLOEXEC */
+
+void
+arena_ring_init(ArenaRing *ring, size_t capacity)
+{
+    int ret;
+
+    assert(ring != NULL);
+    /* Both views are whole pages, mapping 0 bytes would fail */
+    capacity = arena__align__size(capacity);
+    if(capacity < (size_t)ARENA_PAGE_SIZE)
+        capacity = (size_t)ARENA_PAGE_SIZE;
+    if(!arena__ring__mirror(&ring->region, capacity))
+        arena__new__region(&ring->region, capacity, ARENA_HUGE_NONE);
+    ring->head = 0;
+    ring->tail = 0;
+
+    ret = pthread_mutex_init(&ring->mutex, NULL);
+    assert(ret == 0);
+}
+
+/* Maps a memfd of size bytes twice back to back, returns 0 when the kernel does not allow it */
+int
+arena__ring__mirror(Region *region, size_t size)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+    unsigned char *base;
+    int fd, mapped = 0;
+
+    fd = (int)syscall(SYS_memfd_create, "arena_ring", ARENA_MFD_CLOEXEC);
+    if(fd < 0)
+        return 0;
+    if(ftruncate(fd, (off_t)size) == 0){
+        /* Reserve both halves first so nothing else can land in between */
+        base = (unsigned char*)mmap(NULL, 2 * size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if(base != MAP_FAILED){
+            mapped = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED
+                  && mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+            if(!mapped)
+                munmap(base, 2 * size);
+        }
+    }
+    close(fd);
+    if(!mapped)
+        return 0;
+
+    region->flags      = ARENA_REGION_MIRRORED;
+    region->capacity   = size;
+    region->committed  = size;
+    region->count      = 0;
+    region->dirty      = 0;
+    region->idle_since = 0;
+    region->bytes      = base;
+    return 1;
+#else
+    (void)region;
+    (void)size;
+    return 0;
+#endif /*SYS_memfd_create*/
+}
+
+void*
+arena_ring_alloc(ArenaRing *ring, size_t size)
+{
+    size_t capacity, need, pos, skip = 0;
+    unsigned char *block = NULL;
+    int ret;
+
+    assert(ring != NULL);
+    capacity = ring->region.capacity;
+    if(size > capacity)
+        return NULL;
+    need = (ARENA_RING_HEADER + size + ARENA_RING_ALIGN - 1) & ~(ARENA_RING_ALIGN - 1);
+
+    ret = pthread_mutex_lock(&ring->mutex);
+    assert(ret == 0);
+
+    pos = ring->head % capacity;
+    if(!(ring->region.flags & ARENA_REGION_MIRRORED) && need > capacity - pos)
+        skip = capacity - pos;
+    if(skip + need <= capacity - (ring->head - ring->tail)){
+        if(skip != 0){
+            *(size_t*)(ring->region.bytes + pos) = skip | ARENA_RING_RELEASED;
+            ring->head += skip;
+            pos = 0;
+        }
+        block = ring->region.bytes + pos;
+        *(size_t*)block = need;
+        ring->head += need;
+    }
+
+    ret = pthread_mutex_unlock(&ring->mutex);
+    assert(ret == 0);
+    return block != NULL ? block + ARENA_RING_HEADER : NULL;
+}
+
+void
+arena_ring_release(ArenaRing *ring, void *ptr)
+{
+    size_t *header, capacity;
+    int ret;
+
+    assert(ring != NULL);
+    if(ptr == NULL)
+        return;
+    capacity = ring->region.capacity;
+
+    ret = pthread_mutex_lock(&ring->mutex);
+    assert(ret == 0);
+
+    header = (size_t*)((unsigned char*)ptr - ARENA_RING_HEADER);
+    assert(!(*header & ARENA_RING_RELEASED) && "block released twice");
+    *header |= ARENA_RING_RELEASED;
+
+    /* Usually ptr is the oldest block and this runs once */
+    while(ring->tail != ring->head){
+        header = (size_t*)(ring->region.bytes + ring->tail % capacity);
+        if(!(*header & ARENA_RING_RELEASED))
+            break;
+        ring->tail += *header & ~ARENA_RING_RELEASED;
+    }
+
+    ret = pthread_mutex_unlock(&ring->mutex);
+    assert(ret == 0);
+}
+
+size_t
+arena_ring_used(ArenaRing *ring)
+{
+    size_t used;
+    int ret;
+
+    ret = pthread_mutex_lock(&ring->mutex);
+    assert(ret == 0);
+    used = ring->head - ring->tail;
+    ret = pthread_mutex_unlock(&ring->mutex);
+    assert(ret == 0);
+    return used;
+}
+
+void
+arena_ring_destroy(ArenaRing *ring)
+{
+    int ret;
+
+    assert(ring != NULL);
+    arena__free__region(NULL, &ring->region);
+    ring->region.bytes = NULL;
+
+    ret = pthread_mutex_destroy(&ring->mutex);
+    assert(ret == 0);
+}
+
+void
+arena_destroy(Arena *arena)
+{
+    Region *curr;
+    int ret;
+
+    /* Waits for a purge that is walking this arena */
+    if(arena->registered)
+        arena_unregister(arena);
+
+    arena__tc__drop__all(arena);
+    for(curr = arena->regions + arena->nregions; curr-- > arena->regions; )
+        arena__free__region(arena, curr);
+
+    if(arena->heap != NULL){
+        ret = munmap(arena->heap, sizeof(ArenaHeap));
+        assert(ret == 0);
+        arena->heap = NULL;
+    }
+
+    if(arena->parent != NULL)
+        arena__child__return(arena->parent, arena->regions, arena__align__size(arena->max_regions * sizeof(Region)));
+    else
+        arena__descriptors__put(arena->regions);
+    arena->regions  = NULL;
+    arena->nregions = 0;
+    arena->curr = NULL;
+    arena__lookback__clear(arena);
+
+    /* Safe to destroy - no other threads should be using it */
+    ret = pthread_mutex_destroy(&arena->mutex);
+    assert(ret == 0);
+}
+
+/* Maps size bytes aligned to align by over-mapping and unmapping the slack on both sides */
+void*
+arena__map__aligned(size_t size, size_t align)
+{
+    unsigned char *ptr, *aligned;
+    size_t lead;
+    int ret;
+
+    ptr = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ptr == MAP_FAILED)
+        return NULL;
+
+    aligned = (unsigned char*)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+    lead = (size_t)(aligned - ptr);
+    if(lead != 0){
+        ret = munmap(ptr, lead);
+        assert(ret == 0);
+    }
+    ret = munmap(aligned + size, align - lead);
+    assert(ret == 0);
+    return aligned;
+}
+
+void
+arena__new__region(Region *region, size_t size, ArenaHugePages huge)
+{
+    void *ptr = MAP_FAILED;
+
+    region->flags = 0;
+    if(huge != ARENA_HUGE_NONE)
+        size = (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    if(huge == ARENA_HUGE_HUGETLB){
+        /* Fails when the hugetlbfs pool is empty, the kernel aligns these mappings itself */
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED)
+            region->flags = ARENA_REGION_HUGETLB;
+    }
+#endif /*MAP_HUGETLB*/
+
+#ifdef MADV_HUGEPAGE
+    if(ptr == MAP_FAILED && huge != ARENA_HUGE_NONE){
+        ptr = arena__map__aligned(size, ARENA_HUGE_PAGE_SIZE);
+        if(ptr == NULL)
+            ptr = MAP_FAILED;
+        else if(madvise(ptr, size, MADV_HUGEPAGE) == 0)
+            region->flags = ARENA_REGION_THP;
+    }
+#endif /*MADV_HUGEPAGE*/
+
+    region->dirty = 0;
+    if(ptr == MAP_FAILED && huge == ARENA_HUGE_NONE){
+        ptr = arena__cache__get(size, &size);
+        if(ptr == NULL)
+            ptr = MAP_FAILED;
+        else
+            region->dirty = size;   /* still holds whatever its previous arena wrote */
+    }
+
+    if(ptr == MAP_FAILED)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(ptr != MAP_FAILED);
+
+    region->capacity   = size;
+    region->committed  = size;
+    region->count      = 0;
+    region->idle_since = 0;
+    region->bytes      = (unsigned char*)ptr;
+}
+
+/* Reserves address space without backing it, the first commit bytes are usable right away */
+void
+arena__reserve__region(Region *region, size_t reserve, size_t commit, ArenaHugePages huge)
+{
+    void *ptr;
+
+    reserve = (reserve + ARENA_COMMIT_GRANULARITY - 1) & ~(ARENA_COMMIT_GRANULARITY - 1);
+    ptr = mmap(NULL, reserve, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    assert(ptr != MAP_FAILED);
+
+    region->flags      = ARENA_REGION_RESERVED;
+    region->capacity   = reserve;
+    region->committed  = 0;
+    region->count      = 0;
+    region->dirty      = 0;
+    region->idle_since = 0;
+    region->bytes      = (unsigned char*)ptr;
+
+#ifdef MADV_HUGEPAGE
+    if(huge != ARENA_HUGE_NONE && madvise(ptr, reserve, MADV_HUGEPAGE) == 0)
+        region->flags |= ARENA_REGION_THP;
+#else
+    (void)huge;
+#endif /*MADV_HUGEPAGE*/
+
+    if(commit != 0){
+        int ret = arena__region__commit(region, commit);
+        assert(ret);
+    }
+}
+
+/* Makes at least need more bytes past count usable, returns 0 if the region cannot grow */
+int
+arena__region__commit(Region *region, size_t need)
+{
+    size_t committed, target;
+
+    if(!(region->flags & ARENA_REGION_RESERVED))
+        return 0;
+
+    committed = region->committed;
+    if(need > region->capacity - (size_t)region->count)
+        return 0;
+    target = (region->count + need + ARENA_COMMIT_GRANULARITY - 1) & ~(ARENA_COMMIT_GRANULARITY - 1);
+    if(target > region->capacity)
+        target = region->capacity;
+    if(target <= committed)
+        return 0;
+
+    if(mprotect(region->bytes + committed, target - committed, PROT_READ | PROT_WRITE) != 0)
+        return 0;
+#ifdef ARENA_ATOMIC
+    atomic_store_explicit(&region->committed, target, memory_order_release);
+#else
+    region->committed = target;
+#endif /*ARENA_ATOMIC*/
+    return 1;
+}
+
+/* Gives the committed pages above keep back to the kernel, only used on empty regions */
+void
+arena__region__decommit(Region *region, size_t keep)
+{
+    void *ptr;
+
+    if(!(region->flags & ARENA_REGION_RESERVED))
+        return;
+
+    keep = (keep + ARENA_COMMIT_GRANULARITY - 1) & ~(ARENA_COMMIT_GRANULARITY - 1);
+    if(keep >= region->committed)
+        return;
+
+    /* Mapping over the range drops its pages and makes it PROT_NONE in one call */
+    ptr = mmap(region->bytes + keep, region->committed - keep, PROT_NONE,
+               MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    assert(ptr != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+    if(region->flags & ARENA_REGION_THP)
+        madvise(ptr, region->committed - keep, MADV_HUGEPAGE);
+#endif /*MADV_HUGEPAGE*/
+    region->committed = keep;
+    if(region->dirty > keep)
+        region->dirty = keep;
+}
+
+/* Maps a region of size bytes and appends its descriptor, must be called with the mutex held */
+Region*
+arena__push__region(Arena *arena, size_t size)
+{
+    Region *region;
+
+    assert(arena->nregions < arena->max_regions && "raise ARENA_MAX_REGIONS or ARENA_CHILD_MAX_REGIONS");
+    region = &arena->regions[arena->nregions];
+    if(arena->parent != NULL)
+        arena__child__region(arena, region, size);
+    else
+        arena__new__region(region, size, arena->config.huge_pages);
+    arena->nregions++;
+    return region;
+}
+
+/* Maps a region that fits size after the cursor, which is the last region, and moves the cursor
+   to it. The bytes are reserved before the region becomes visible to the lock-free fast path.
+   Must be called with the mutex held */
+void*
+arena__append__region(Arena *arena, size_t size, size_t align, Region **out)
+{
+    Region *region;
+    size_t region_size, need = size;
+    void *ptr;
+
+    /* Regions start page-aligned, only larger alignments need padding */
+    if(align > (size_t)ARENA_PAGE_SIZE)
+        need += align - 1;
+    region_size = arena__region__size(arena, need);
+    region = arena__push__region(arena, region_size);
+    ptr = arena__region__bump(region, size, align);
+    assert(ptr != NULL);
+
+#ifdef ARENA_ATOMIC
+    atomic_store_explicit(&arena->curr, region, memory_order_release);
+#else
+    arena->curr = region;
+#endif /*ARENA_ATOMIC*/
+
+    if(out != NULL)
+        *out = region;
+    return ptr;
+}
+
+/* Mapping size of the next region for a request of size bytes, according to the growth policy */
+size_t
+arena__region__size(Arena *arena, size_t size)
+{
+    size_t region_size;
+
+    if(arena->config.growth == ARENA_GROWTH_FIXED){
+        if(size < (size_t)ARENA_REGION_DEFAULT_CAPACITY)
+            return ARENA_REGION_DEFAULT_CAPACITY;
+        return arena__align__size(size);
+    }
+
+    region_size = arena->next_region_size;
+    if(region_size < (size_t)ARENA_REGION_DEFAULT_CAPACITY)
+        region_size = ARENA_REGION_DEFAULT_CAPACITY;
+    if(size > region_size)
+        region_size = arena__align__size(size);
+
+    arena->next_region_size = region_size * 2;
+    if(arena->next_region_size > arena->config.max_region_size)
+        arena->next_region_size = arena->config.max_region_size;
+    return region_size;
+}
+
+/*
+    Adaptive growth, called by arena_reset before the regions are emptied. The bytes in use
+    are the high-water mark of the cycle that just ended: growth restarts at that size, and an
+    arena that needed several regions is replaced by a single one if it fits under the cap.
+*/
+void
+arena__adapt(Arena *arena)
+{
+    Region *curr;
+    size_t used = 0, region_size;
+
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr)
+        used += curr->count;
+
+    region_size = arena__align__size(used);
+    if(region_size < (size_t)ARENA_REGION_DEFAULT_CAPACITY)
+        region_size = (size_t)ARENA_REGION_DEFAULT_CAPACITY;
+    if(region_size > arena->config.max_region_size)
+        region_size = arena->config.max_region_size;
+    arena->next_region_size = region_size;
+
+    if(arena->nregions == 1 || used > region_size)
+        return;
+
+    /* Last first, like arena__retain */
+    for(curr = arena->regions + arena->nregions; curr-- > arena->regions; )
+        arena__free__region(arena, curr);
+    arena->nregions = 0;
+    arena__push__region(arena, region_size);
+}
+
+/*
+    Retention policy, called by arena_reset before the regions are emptied. Regions are kept
+    resident in order until retain_regions regions and the retained bytes are covered, where
+    the retained bytes follow a decaying average of the peaks seen at reset when retain_decay
+    is set. The remaining regions are released, so an arena that spiked once follows its real
+    load instead of pinning the spike forever. The first region, which is the reserved one in
+    reserve mode, is always kept.
+*/
+void
+arena__retain(Arena *arena)
+{
+    Region *curr, *end;
+    size_t used = 0, kept = 0, target, keep;
+    int ret;
+
+    end = arena->regions + arena->nregions;
+    for(curr = arena->regions; curr < end; ++curr)
+        used += curr->count;
+
+    target = arena->config.retain_bytes;
+    if(arena->config.retain_decay != 0){
+        arena->peak_average = arena->peak_average
+                            - (arena->peak_average >> arena->config.retain_decay)
+                            + (used >> arena->config.retain_decay);
+        if(arena->peak_average > target)
+            target = arena->peak_average;
+    }
+
+    /* Once a region is not kept none of the following ones is */
+    for(keep = 0; keep < arena->nregions; ++keep){
+        if(keep != 0 && keep >= arena->config.retain_regions && kept >= target)
+            break;
+        kept += arena->regions[keep].capacity;
+    }
+
+    /* Last first, so that a child can roll its parent's bump pointer back */
+    for(curr = end; curr-- > arena->regions + keep; ){
+        if(arena->config.release == ARENA_RELEASE_UNMAP){
+            arena__free__region(arena, curr);
+            continue;
+        }
+#ifdef MADV_FREE
+        /* Kernels older than 4.5 lack MADV_FREE, fall back to MADV_DONTNEED */
+        if(arena->config.release == ARENA_RELEASE_FREE && madvise(curr->bytes, curr->capacity, MADV_FREE) == 0)
+            continue;
+#endif /*MADV_FREE*/
+        ret = madvise(curr->bytes, curr->capacity, MADV_DONTNEED);
+        assert(ret == 0);
+        curr->count = 0;
+        curr->dirty = 0;
+    }
+
+    if(arena->config.release == ARENA_RELEASE_UNMAP)
+        arena->nregions = keep;
+}
+
+/* Lowers count to a smaller value, used by reset and rewind which hold the mutex */
+void
+arena__region__lower(Region *region, size_t count, uint64_t now)
+{
+    arena__region__dirty(region, region->count);
+    region->count = count;
+    region->idle_since = now;
+}
+
+/* Records that the bytes below upto may have been written */
+void
+arena__region__dirty(Region *region, size_t upto)
+{
+#ifdef ARENA_ATOMIC
+    size_t dirty = atomic_load_explicit(&region->dirty, memory_order_relaxed);
+    while(dirty < upto && !atomic_compare_exchange_weak_explicit(&region->dirty, &dirty, upto,
+                                                                memory_order_relaxed, memory_order_relaxed))
+        ;
+#else
+    if(region->dirty < upto)
+        region->dirty = upto;
+#endif /*ARENA_ATOMIC*/
+}
+
+uint64_t
+arena__now__ms(void)
+{
+    struct timespec ts;
+    int ret;
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(ret == 0);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void
+arena__region__dump(Region* region)
+{
+    assert(region != NULL);
+    printf("Descriptor: %p\n", (void*)region);
+    printf("Starts at:  %p\n", (void*)region->bytes);
+    printf("Capacity:   %zu bytes%s\n", region->capacity,
+           (region->flags & ARENA_REGION_HUGETLB) ? " (hugetlb)" :
+           (region->flags & ARENA_REGION_THP) ? " (thp)" :
+           (region->flags & ARENA_REGION_CHILD) ? " (child)" : "");
+    if(region->flags & ARENA_REGION_RESERVED)
+        printf("Committed:  %zu bytes\n", (size_t)region->committed);
+    printf("Used:       %zu bytes\n", (size_t)region->count);
+    printf("Free:       %zu bytes\n", (size_t)region->committed - (size_t)region->count);
+    printf("\n");
+}
+
+void
+arena__free__region(Arena *arena, Region* region)
+{
+    assert(region != NULL);
+    if(region->flags & ARENA_REGION_CHILD){
+        arena__child__return(arena->parent, region->bytes, region->capacity);
+        return;
+    }
+    if(region->flags & ARENA_REGION_MIRRORED){
+        int ret = munmap(region->bytes, 2 * region->capacity);
+        assert(ret == 0);
+        return;
+    }
+    /* Only plain regions are cached, huge page and reserved mappings would not match a plain request */
+    if(region->flags == 0 && arena__cache__put(region->bytes, region->capacity))
+        return;
+    int ret = munmap(region->bytes, region->capacity);
+    assert(ret == 0);
+}
+
+/*
+    Page-aligned block of size bytes for a child, taken from the parent's free lists when an
+    earlier child left one there and bumped from the parent otherwise. Only the head of the
+    size class is tried, what the block has beyond size goes back on the free lists. Must be
+    called with the parent's mutex held
+*/
+void*
+arena__child__take(Arena *parent, size_t size, Region **from)
+{
+    ArenaFreeBlock *block;
+    size_t rest;
+
+    if(arena__free__waiting(parent, size)
+       && ((uintptr_t)parent->free_lists[arena__free__class(size)] & ((size_t)ARENA_PAGE_SIZE - 1)) == 0){
+        block = (ArenaFreeBlock*)arena__free__get(parent, size);
+        rest  = block->size - size;
+        if(rest != 0)
+            arena__free__put(parent, (unsigned char*)block + size, rest);
+        if(from != NULL)
+            *from = arena__region__owner(parent, block);
+        return block;
+    }
+    return arena__alloc__region(parent, size, (size_t)ARENA_PAGE_SIZE, from);
+}
+
+/*
+    Child arenas take their regions from the parent under the parent's mutex, the child's
+    mutex is always taken first. The part of the block the parent never wrote is still known
+    to be zero, and hugetlb backing is inherited so madvise is not tried on parts of a huge page.
+*/
+void
+arena__child__region(Arena *arena, Region *region, size_t size)
+{
+    Arena *parent = arena->parent;
+    Region *from = NULL;
+    size_t offset, dirty;
+    int ret;
+
+    ret = pthread_mutex_lock(&parent->mutex);
+    assert(ret == 0);
+    region->bytes = (unsigned char*)arena__child__take(parent, size, &from);
+    offset = region->bytes - from->bytes;
+    dirty  = from->dirty;
+    region->flags = ARENA_REGION_CHILD | (from->flags & ARENA_REGION_HUGETLB);
+    ret = pthread_mutex_unlock(&parent->mutex);
+    assert(ret == 0);
+
+    region->capacity   = size;
+    region->committed  = size;
+    region->count      = 0;
+    region->dirty      = offset < dirty ? (dirty - offset < size ? dirty - offset : size) : 0;
+    region->idle_since = 0;
+}
+
+/* Gives size bytes at ptr back to the parent. The bump pointer of the parent region holding
+   them is rolled back when they are its last allocation, and the cursor follows it back over
+   regions left empty. Otherwise they go on the parent's free lists for the next child */
+void
+arena__child__return(Arena *parent, void *ptr, size_t size)
+{
+    unsigned char *bytes = (unsigned char*)ptr;
+    Region *region;
+    size_t count;
+    int ret;
+
+    ret = pthread_mutex_lock(&parent->mutex);
+    assert(ret == 0);
+
+    region = arena__region__owner(parent, bytes);
+    assert(region != NULL && "block was not lent by this parent");
+    count = region->count;
+    if(bytes + size == region->bytes + count && arena__region__move(region, count, (size_t)(bytes - region->bytes)))
+        arena__curr__retreat(parent, region);
+    else
+        arena__free__put(parent, bytes, size);
+
+    ret = pthread_mutex_unlock(&parent->mutex);
+    assert(ret == 0);
+}
+
+/*
+    Process-wide cache of freed regions. arena__free__region parks plain regions here instead
+    of unmapping them and arena__new__region takes them back, so arenas that live for a single
+    request reuse memory that is already faulted in instead of paying for mmap, munmap and the
+    TLB shootdowns munmap triggers. Cached regions are bucketed by floor(log2(size)), the
+    bookkeeping lives in the first bytes of each cached region. Descriptor arrays are kept on
+    a short list of their own, they are mostly untouched address space.
+*/
+typedef struct ArenaCachedRegion ArenaCachedRegion;
+struct ArenaCachedRegion{
+    ArenaCachedRegion *next;
+    size_t size;
+};
+
+static pthread_mutex_t arena__cache__mutex = PTHREAD_MUTEX_INITIALIZER;
+static ArenaCachedRegion *arena__cache__buckets[sizeof(size_t) * 8];
+static size_t arena__cache__total;
+static size_t arena__cache__limit = ARENA_REGION_CACHE_LIMIT;
+static void *arena__cache__descriptors[ARENA_CACHE_DESCRIPTOR_ARRAYS];
+static size_t arena__cache__ndescriptors;
+
+static size_t
+arena__cache__bucket(size_t size)
+{
+    size_t bucket = 0;
+    while(size >>= 1)
+        bucket++;
+    return bucket;
+}
+
+/* Returns a cached region of at least size bytes and less than twice that, or NULL */
+void*
+arena__cache__get(size_t size, size_t *got)
+{
+    ArenaCachedRegion **link, *cached = NULL;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+
+    for(link = &arena__cache__buckets[arena__cache__bucket(size)]; *link != NULL; link = &(*link)->next){
+        if((*link)->size >= size){
+            cached = *link;
+            *link = cached->next;
+            arena__cache__total -= cached->size;
+            *got = cached->size;
+            break;
+        }
+    }
+
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+    return cached;
+}
+
+/* Returns 0 when the region does not fit under the cache limit and has to be unmapped */
+int
+arena__cache__put(void *ptr, size_t size)
+{
+    ArenaCachedRegion *cached = (ArenaCachedRegion*)ptr;
+    size_t bucket;
+    int ret, ok = 0;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+
+    if(size <= arena__cache__limit - arena__cache__total && arena__cache__total <= arena__cache__limit){
+        bucket = arena__cache__bucket(size);
+        cached->size = size;
+        cached->next = arena__cache__buckets[bucket];
+        arena__cache__buckets[bucket] = cached;
+        arena__cache__total += size;
+        ok = 1;
+    }
+
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+    return ok;
+}
+
+/* Unmaps cached regions, largest first, until the cache holds at most limit bytes. Called with the cache mutex held */
+void
+arena__cache__shrink(size_t limit)
+{
+    ArenaCachedRegion *cached;
+    size_t bucket, size;
+    int ret;
+
+    for(bucket = ARENA_SIZE_ARR(arena__cache__buckets); bucket-- > 0 && arena__cache__total > limit;){
+        while(arena__cache__buckets[bucket] != NULL && arena__cache__total > limit){
+            cached = arena__cache__buckets[bucket];
+            arena__cache__buckets[bucket] = cached->next;
+            size = cached->size;
+            arena__cache__total -= size;
+            ret = munmap(cached, size);
+            assert(ret == 0);
+        }
+    }
+
+    if(limit == 0){
+        while(arena__cache__ndescriptors > 0){
+            ret = munmap(arena__cache__descriptors[--arena__cache__ndescriptors], ARENA_MAX_REGIONS * sizeof(Region));
+            assert(ret == 0);
+        }
+    }
+}
+
+void*
+arena__descriptors__get(void)
+{
+    void *ptr = NULL;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+    if(arena__cache__ndescriptors > 0)
+        ptr = arena__cache__descriptors[--arena__cache__ndescriptors];
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+
+    if(ptr == NULL){
+        ptr = mmap(NULL, ARENA_MAX_REGIONS * sizeof(Region), PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        assert(ptr != MAP_FAILED);
+    }
+    return ptr;
+}
+
+void
+arena__descriptors__put(void *ptr)
+{
+    int ret, cached = 0;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+    if(arena__cache__limit != 0 && arena__cache__ndescriptors < ARENA_CACHE_DESCRIPTOR_ARRAYS){
+        arena__cache__descriptors[arena__cache__ndescriptors++] = ptr;
+        cached = 1;
+    }
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+
+    if(!cached){
+        ret = munmap(ptr, ARENA_MAX_REGIONS * sizeof(Region));
+        assert(ret == 0);
+    }
 }
 
 void
-arena__region__dump(Region* region)
+arena_cache_set_limit(size_t bytes)
 {
-    assert(region != NULL);
-    printf("Address:    %p\n", (void*)region);
-    printf("Starts at:  %p\n", (void*)region->bytes);
-    printf("Next:       %p\n", (void*)region->next);
-    printf("Capacity:   %zu bytes\n", region->capacity);
-    printf("Used:       %zu bytes\n", region->count);
-    printf("Free:       %zu bytes\n", region->remaining);
-    printf("\n");
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+    arena__cache__limit = bytes;
+    arena__cache__shrink(bytes);
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
 }
 
 void
-arena__free__region(Region* region)
+arena_cache_trim(void)
 {
-    assert(region != NULL);
-    size_t size_bytes = ARENA_REGION_SIZE + region->capacity;
-    int ret = munmap(region, size_bytes);
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+    arena__cache__shrink(0);
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+}
+
+size_t
+arena_cache_bytes(void)
+{
+    size_t total;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__cache__mutex);
+    assert(ret == 0);
+    total = arena__cache__total;
+    ret = pthread_mutex_unlock(&arena__cache__mutex);
+    assert(ret == 0);
+    return total;
+}
+
+/* Smallest size class whose blocks all fit size bytes, the ceiling of log2(size) */
+size_t
+arena__free__class(size_t size)
+{
+    size_t bucket = arena__cache__bucket(size);
+    return ARENA_IS_POW2(size) ? bucket : bucket + 1;
+}
+
+/* Whether a block for size bytes is on the free lists, a hint when read without the mutex */
+int
+arena__free__waiting(Arena *arena, size_t size)
+{
+    size_t bucket, mask;
+
+#ifdef ARENA_ATOMIC
+    mask = atomic_load_explicit(&arena->free_mask, memory_order_relaxed);
+#else
+    mask = arena->free_mask;
+#endif /*ARENA_ATOMIC*/
+    if(mask == 0)
+        return 0;
+    bucket = arena__free__class(size);
+    return bucket < ARENA_SIZE_ARR(arena->free_lists) && (mask >> bucket & 1);
+}
+
+/* Pops a block of at least size bytes, must be called with the mutex held */
+void*
+arena__free__get(Arena *arena, size_t size)
+{
+    ArenaFreeBlock *block;
+    size_t bucket = arena__free__class(size);
+
+    if(!arena__free__waiting(arena, size))
+        return NULL;
+
+    block = arena->free_lists[bucket];
+    arena->free_lists[bucket] = block->next;
+    if(block->next == NULL)
+        arena->free_mask &= ~((size_t)1 << bucket);
+    arena->free_bytes     -= block->size;
+    arena->recycled_bytes += block->size;
+    return block;
+}
+
+/* Files an orphaned block under floor(log2(size)), must be called with the mutex held */
+void
+arena__free__put(Arena *arena, void *ptr, size_t size)
+{
+    ArenaFreeBlock *block = (ArenaFreeBlock*)ptr;
+    size_t bucket;
+
+    /* Recycled blocks are handed out with the default alignment */
+    if(size < sizeof(ArenaFreeBlock) || ((uintptr_t)ptr & (ARENA_DEFAULT_ALIGNMENT - 1)) != 0)
+        return;
+
+    bucket = arena__cache__bucket(size);
+    block->size = size;
+    block->next = arena->free_lists[bucket];
+    arena->free_lists[bucket] = block;
+    arena->free_mask |= (size_t)1 << bucket;
+    arena->free_bytes += size;
+}
+
+void
+arena__free__clear(Arena *arena)
+{
+    size_t i;
+
+    if(arena->free_mask == 0)
+        return;
+    for(i = 0; i < ARENA_SIZE_ARR(arena->free_lists); ++i)
+        arena->free_lists[i] = NULL;
+    arena->free_mask  = 0;
+    arena->free_bytes = 0;
+}
+
+void
+arena__heap__init(Arena *arena)
+{
+    void *ptr;
+
+    assert(arena->config.reserve == 0 && "heap mode does not support reserve mode");
+    ptr = mmap(NULL, sizeof(ArenaHeap), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(ptr != MAP_FAILED);
+    arena->heap = (ArenaHeap*)ptr;
+    arena__heap__add(arena->heap, arena->curr);
+}
+
+/* Turns the whole region into one free block followed by the sentinel */
+void
+arena__heap__add(ArenaHeap *heap, Region *region)
+{
+    ArenaHeapBlock *block, *sentinel;
+
+    block = (ArenaHeapBlock*)region->bytes;
+    block->prev_phys = NULL;
+    block->size = ((region->capacity - 2 * ARENA_HEAP_HEADER) & ~(ARENA_HEAP_ALIGN - 1)) | ARENA_HEAP_FREE;
+    sentinel = ARENA_HEAP_NEXT(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+    region->count = region->capacity;
+    arena__heap__insert(heap, block);
+}
+
+void
+arena__heap__mapping(size_t size, size_t *fl, size_t *sl)
+{
+    size_t log2;
+
+    if(size < ARENA_HEAP_SMALL){
+        *fl = 0;
+        *sl = size / (ARENA_HEAP_SMALL / ARENA_HEAP_SL_COUNT);
+        return;
+    }
+    log2 = sizeof(size_t) * 8 - 1 - (size_t)__builtin_clzl(size);
+    *sl = (size >> (log2 - ARENA_HEAP_SL_LOG2)) ^ ((size_t)1 << ARENA_HEAP_SL_LOG2);
+    *fl = log2 - ARENA_HEAP_FL_SHIFT + 1;
+    assert(*fl < ARENA_HEAP_FL_COUNT);
+}
+
+/* Rounding up to the next list boundary means any block of the list fits */
+size_t
+arena__heap__round(size_t size)
+{
+    if(size >= ARENA_HEAP_SMALL)
+        size += ((size_t)1 << (sizeof(size_t) * 8 - 1 - (size_t)__builtin_clzl(size) - ARENA_HEAP_SL_LOG2)) - 1;
+    return size;
+}
+
+void
+arena__heap__insert(ArenaHeap *heap, ArenaHeapBlock *block)
+{
+    size_t fl, sl;
+
+    arena__heap__mapping(ARENA_HEAP_SIZE(block), &fl, &sl);
+    block->prev_free = NULL;
+    /* Heads of empty lists are stale after arena__heap__reset, only the bitmaps are cleared */
+    block->next_free = (heap->sl_bitmap[fl] >> sl & 1) ? heap->blocks[fl][sl] : NULL;
+    if(block->next_free != NULL)
+        block->next_free->prev_free = block;
+    heap->blocks[fl][sl] = block;
+    heap->fl_bitmap     |= (uint32_t)1 << fl;
+    heap->sl_bitmap[fl] |= (uint32_t)1 << sl;
+}
+
+void
+arena__heap__remove(ArenaHeap *heap, ArenaHeapBlock *block)
+{
+    size_t fl, sl;
+
+    arena__heap__mapping(ARENA_HEAP_SIZE(block), &fl, &sl);
+    if(block->next_free != NULL)
+        block->next_free->prev_free = block->prev_free;
+    if(block->prev_free != NULL){
+        block->prev_free->next_free = block->next_free;
+        return;
+    }
+    heap->blocks[fl][sl] = block->next_free;
+    if(block->next_free == NULL){
+        heap->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+        if(heap->sl_bitmap[fl] == 0)
+            heap->fl_bitmap &= ~((uint32_t)1 << fl);
+    }
+}
+
+/* First free block of a list whose every block holds size bytes, NULL if there is none */
+ArenaHeapBlock*
+arena__heap__find(ArenaHeap *heap, size_t size)
+{
+    size_t fl, sl;
+    uint32_t sl_map, fl_map;
+
+    arena__heap__mapping(arena__heap__round(size), &fl, &sl);
+
+    sl_map = heap->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+    if(sl_map == 0){
+        fl_map = fl + 1 < ARENA_HEAP_FL_COUNT ? heap->fl_bitmap & (~(uint32_t)0 << (fl + 1)) : 0;
+        if(fl_map == 0)
+            return NULL;
+        fl = (size_t)__builtin_ctz(fl_map);
+        sl_map = heap->sl_bitmap[fl];
+    }
+    sl = (size_t)__builtin_ctz(sl_map);
+    return heap->blocks[fl][sl];
+}
+
+/* Cuts a used block down to size bytes, the remainder is freed and merged with a free next block */
+void
+arena__heap__split(ArenaHeap *heap, ArenaHeapBlock *block, size_t size)
+{
+    ArenaHeapBlock *rest, *next;
+
+    if(ARENA_HEAP_SIZE(block) < size + ARENA_HEAP_HEADER + ARENA_HEAP_MIN)
+        return;
+
+    rest = (ArenaHeapBlock*)((unsigned char*)ARENA_HEAP_PAYLOAD(block) + size);
+    rest->prev_phys = block;
+    rest->size = ARENA_HEAP_SIZE(block) - size - ARENA_HEAP_HEADER;
+    heap->used -= rest->size + ARENA_HEAP_HEADER;
+    block->size = size;
+
+    next = ARENA_HEAP_NEXT(rest);
+    if(next->size & ARENA_HEAP_FREE){
+        arena__heap__remove(heap, next);
+        rest->size += ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(next);
+        next = ARENA_HEAP_NEXT(rest);
+    }
+    next->prev_phys = rest;
+    rest->size |= ARENA_HEAP_FREE;
+    arena__heap__insert(heap, rest);
+}
+
+/* Must be called with the mutex held, maps a new region when no free block fits */
+void*
+arena__heap__alloc(Arena *arena, size_t size, size_t align)
+{
+    ArenaHeap *heap = arena->heap;
+    ArenaHeapBlock *block, *lead;
+    size_t need, gap;
+    uintptr_t payload, aligned;
+
+    size = (size + ARENA_HEAP_ALIGN - 1) & ~(ARENA_HEAP_ALIGN - 1);
+    if(size < ARENA_HEAP_MIN)
+        size = ARENA_HEAP_MIN;
+    if(align < ARENA_HEAP_ALIGN)
+        align = ARENA_HEAP_ALIGN;
+
+    /* Larger alignments need room to split a free block off the front */
+    need = size;
+    if(align > ARENA_HEAP_ALIGN)
+        need += align + ARENA_HEAP_HEADER + ARENA_HEAP_MIN;
+
+    block = arena__heap__find(heap, need);
+    if(block == NULL){
+        /* The region's free block must land in a list arena__heap__find searches */
+        arena__heap__add(heap, arena__push__region(arena, arena__region__size(arena, arena__heap__round(need) + 2 * ARENA_HEAP_HEADER)));
+        block = arena__heap__find(heap, need);
+        assert(block != NULL);
+    }
+    arena__heap__remove(heap, block);
+    block->size &= ~ARENA_HEAP_FREE;
+    heap->used += ARENA_HEAP_SIZE(block) + ARENA_HEAP_HEADER;
+
+    payload = (uintptr_t)ARENA_HEAP_PAYLOAD(block);
+    aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
+    if(aligned != payload){
+        /* The gap in front becomes a free block of its own, so it needs room for one */
+        if(aligned - payload < ARENA_HEAP_HEADER + ARENA_HEAP_MIN)
+            aligned = (payload + ARENA_HEAP_HEADER + ARENA_HEAP_MIN + align - 1) & ~(uintptr_t)(align - 1);
+        gap = (size_t)(aligned - payload);
+
+        lead  = block;
+        block = ARENA_HEAP_BLOCK(aligned);
+        block->prev_phys = lead;
+        block->size = ARENA_HEAP_SIZE(lead) - gap;
+        ARENA_HEAP_NEXT(block)->prev_phys = block;
+        lead->size = (gap - ARENA_HEAP_HEADER) | ARENA_HEAP_FREE;
+        heap->used -= gap;
+        /* lead came off a free list, so its previous block is in use and nothing merges */
+        arena__heap__insert(heap, lead);
+    }
+
+    arena__heap__split(heap, block, size);
+    return ARENA_HEAP_PAYLOAD(block);
+}
+
+void
+arena__heap__free(ArenaHeap *heap, void *ptr)
+{
+    ArenaHeapBlock *block = ARENA_HEAP_BLOCK(ptr), *prev, *next;
+
+    assert(!(block->size & ARENA_HEAP_FREE) && "double free");
+    heap->used -= ARENA_HEAP_SIZE(block) + ARENA_HEAP_HEADER;
+
+    prev = block->prev_phys;
+    if(prev != NULL && (prev->size & ARENA_HEAP_FREE)){
+        arena__heap__remove(heap, prev);
+        prev->size = ARENA_HEAP_SIZE(prev) + ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(block);
+        block = prev;
+    }
+    next = ARENA_HEAP_NEXT(block);
+    if(next->size & ARENA_HEAP_FREE){
+        arena__heap__remove(heap, next);
+        block->size = ARENA_HEAP_SIZE(block) + ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(next);
+        next = ARENA_HEAP_NEXT(block);
+    }
+    next->prev_phys = block;
+    block->size |= ARENA_HEAP_FREE;
+    arena__heap__insert(heap, block);
+}
+
+/* Must be called with the mutex held */
+void*
+arena__heap__realloc(Arena *arena, void *ptr, size_t size)
+{
+    ArenaHeap *heap = arena->heap;
+    ArenaHeapBlock *block = ARENA_HEAP_BLOCK(ptr), *next;
+    size_t have;
+    void *new_ptr;
+
+    size = (size + ARENA_HEAP_ALIGN - 1) & ~(ARENA_HEAP_ALIGN - 1);
+    if(size < ARENA_HEAP_MIN)
+        size = ARENA_HEAP_MIN;
+    have = ARENA_HEAP_SIZE(block);
+
+    /* Grow into a free next neighbour when together they are large enough */
+    next = ARENA_HEAP_NEXT(block);
+    if(size > have && (next->size & ARENA_HEAP_FREE) && have + ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(next) >= size){
+        arena__heap__remove(heap, next);
+        block->size = have + ARENA_HEAP_HEADER + ARENA_HEAP_SIZE(next);
+        ARENA_HEAP_NEXT(block)->prev_phys = block;
+        heap->used += ARENA_HEAP_SIZE(block) - have;
+        have = ARENA_HEAP_SIZE(block);
+    }
+
+    if(size <= have){
+        arena__heap__split(heap, block, size);
+        return ptr;
+    }
+
+    new_ptr = arena__heap__alloc(arena, size, ARENA_HEAP_ALIGN);
+    arena_memcpy(new_ptr, ptr, have);
+    arena__heap__free(heap, ptr);
+    return new_ptr;
+}
+
+/* Called by arena_reset with the mutex held, every region becomes one free block again */
+void
+arena__heap__reset(Arena *arena)
+{
+    ArenaHeap *heap = arena->heap;
+    Region *curr;
+    size_t i;
+
+    heap->fl_bitmap = 0;
+    for(i = 0; i < ARENA_HEAP_FL_COUNT; ++i)
+        heap->sl_bitmap[i] = 0;
+    heap->used = 0;
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr)
+        arena__heap__add(heap, curr);
+}
+
+/*
+    Object pools. Items come from the pool's free list, or are bumped out of the current
+    slab, both under the arena mutex. With magazines each thread also keeps up to `magazine`
+    freed items per pool in a thread-local list: get and put then only take the mutex when the
+    magazine runs empty or full, and move half a magazine at a time. A thread holds magazines
+    for ARENA_POOL_MAGAZINE_SLOTS pools, the items of an evicted magazine, or of one left behind
+    by an exiting thread, are not returned to their pool (the pool may be gone already), they
+    are reclaimed with the rest of the arena.
+*/
+typedef struct{
+    unsigned long pool;        /* ArenaPool.id, 0 for an unused slot */
+    void *head;
+    size_t count;
+} ArenaPoolMagazine;
+
+static ARENA_THREAD_LOCAL ArenaPoolMagazine arena__magazines[ARENA_POOL_MAGAZINE_SLOTS];
+static ARENA_THREAD_LOCAL size_t arena__magazines__victim;
+static pthread_mutex_t arena__pool__mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long arena__pool__ids;
+
+void
+arena_pool_init(ArenaPool *pool, Arena *arena, size_t item_size, size_t item_align, size_t magazine)
+{
+    int ret;
+
+    assert(pool != NULL);
+    assert(arena != NULL);
+    assert(ARENA_IS_POW2(item_align));
+
+    if(item_align < _Alignof(void*))
+        item_align = _Alignof(void*);
+    if(item_size < sizeof(void*))
+        item_size = sizeof(void*);
+    item_size = (item_size + item_align - 1) & ~(item_align - 1);
+
+    pool->arena      = arena;
+    pool->item_size  = item_size;
+    pool->item_align = item_align;
+    pool->slab_items = item_size < ARENA_POOL_SLAB_SIZE ? ARENA_POOL_SLAB_SIZE / item_size : 1;
+    pool->slab_cur   = NULL;
+    pool->slab_end   = NULL;
+    pool->free       = NULL;
+    pool->magazine   = magazine;
+
+    ret = pthread_mutex_lock(&arena__pool__mutex);
+    assert(ret == 0);
+    pool->id = ++arena__pool__ids;
+    ret = pthread_mutex_unlock(&arena__pool__mutex);
+    assert(ret == 0);
+}
+
+/* Returns the calling thread's magazine for the pool, evicting another pool's if all slots are taken */
+static ArenaPoolMagazine*
+arena__pool__magazine(ArenaPool *pool)
+{
+    ArenaPoolMagazine *mag, *empty = NULL;
+    size_t i;
+
+    for(i = 0; i < ARENA_POOL_MAGAZINE_SLOTS; ++i){
+        if(arena__magazines[i].pool == pool->id)
+            return &arena__magazines[i];
+        if(empty == NULL && arena__magazines[i].pool == 0)
+            empty = &arena__magazines[i];
+    }
+
+    mag = empty;
+    if(mag == NULL){
+        mag = &arena__magazines[arena__magazines__victim];
+        arena__magazines__victim = (arena__magazines__victim + 1) % ARENA_POOL_MAGAZINE_SLOTS;
+    }
+    mag->pool  = pool->id;
+    mag->head  = NULL;
+    mag->count = 0;
+    return mag;
+}
+
+/* Pops the free list or bumps the slab, must be called with the arena mutex held */
+void*
+arena__pool__take(ArenaPool *pool)
+{
+    void *item;
+
+    if(pool->free != NULL){
+        item = pool->free;
+        pool->free = *(void**)item;
+        return item;
+    }
+    if(pool->slab_cur == pool->slab_end){
+        /* Heap mode slabs must be heap blocks, a bump region would become the cursor */
+        if(pool->arena->heap != NULL)
+            pool->slab_cur = (unsigned char*)arena__heap__alloc(pool->arena, pool->item_size * pool->slab_items,
+                                                                pool->item_align);
+        else
+            pool->slab_cur = (unsigned char*)arena__alloc__aligned__unlocked(pool->arena, pool->item_size * pool->slab_items,
+                                                                            pool->item_align);
+        pool->slab_end = pool->slab_cur + pool->item_size * pool->slab_items;
+    }
+    item = pool->slab_cur;
+    pool->slab_cur += pool->item_size;
+    return item;
+}
+
+void*
+arena_pool_get(ArenaPool *pool)
+{
+    ArenaPoolMagazine *mag = NULL;
+    void *item;
+    int ret;
+
+    assert(pool != NULL);
+    if(pool->magazine != 0){
+        mag = arena__pool__magazine(pool);
+        if(mag->count != 0){
+            item = mag->head;
+            mag->head = *(void**)item;
+            mag->count--;
+            return item;
+        }
+    }
+
+    ret = pthread_mutex_lock(&pool->arena->mutex);
+    assert(ret == 0);
+
+    /* Refill half of the magazine from the free list, slabs are only bumped on demand */
+    if(mag != NULL){
+        while(mag->count < pool->magazine / 2 && pool->free != NULL){
+            item = pool->free;
+            pool->free = *(void**)item;
+            *(void**)item = mag->head;
+            mag->head = item;
+            mag->count++;
+        }
+    }
+    item = arena__pool__take(pool);
+
+    ret = pthread_mutex_unlock(&pool->arena->mutex);
+    assert(ret == 0);
+    return item;
+}
+
+void
+arena_pool_put(ArenaPool *pool, void *item)
+{
+    ArenaPoolMagazine *mag;
+    void *moved;
+    int ret;
+
+    assert(pool != NULL);
+    if(item == NULL)
+        return;
+
+    if(pool->magazine != 0){
+        mag = arena__pool__magazine(pool);
+        if(mag->count >= pool->magazine){
+            /* Full, half of it goes back to the pool */
+            ret = pthread_mutex_lock(&pool->arena->mutex);
+            assert(ret == 0);
+            while(mag->count > pool->magazine / 2){
+                moved = mag->head;
+                mag->head = *(void**)moved;
+                *(void**)moved = pool->free;
+                pool->free = moved;
+                mag->count--;
+            }
+            ret = pthread_mutex_unlock(&pool->arena->mutex);
+            assert(ret == 0);
+        }
+        *(void**)item = mag->head;
+        mag->head = item;
+        mag->count++;
+        return;
+    }
+
+    ret = pthread_mutex_lock(&pool->arena->mutex);
+    assert(ret == 0);
+    *(void**)item = pool->free;
+    pool->free = item;
+    ret = pthread_mutex_unlock(&pool->arena->mutex);
+    assert(ret == 0);
+}
+
+/*
+    Process-wide registry of arenas. Long-lived arenas that go quiet keep their pages resident
+    until the next arena_reset, registering them lets arena_purge_all or the purge thread hand
+    those pages back with MADV_DONTNEED: the tail of each region past its count that earlier
+    allocations dirtied, and whole regions that sit empty, once they have been idle for the
+    decay time. The arena keeps its address space, purged pages read back as zero.
+    Lock order is the registry mutex, then the arena mutex.
+*/
+static pthread_mutex_t arena__registry__mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arena__purge__cond = PTHREAD_COND_INITIALIZER;
+static Arena *arena__registry;
+static pthread_t arena__purge__tid;
+static int arena__purge__running;
+static unsigned arena__purge__interval_ms;
+static unsigned arena__purge__decay_ms;
+
+/* Purges the idle pages of one arena, called with the registry mutex held */
+size_t
+arena__purge(Arena *arena, uint64_t now, uint64_t decay_ms)
+{
+    Region *curr;
+    size_t count, high, start, end, granularity, purged = 0;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena->mutex);
+    assert(ret == 0);
+
+    for(curr = arena->regions; curr < arena->regions + arena->nregions; ++curr){
+        /* hugetlb pages cannot be split, a partial MADV_DONTNEED would fail */
+        if(curr->flags & ARENA_REGION_HUGETLB)
+            continue;
+        /* idle_since only moves when count is lowered, bumping does not touch it. A region in
+           use since the last reset is thus purged decay_ms after that reset, which only costs
+           the page faults of its dirty tail if it grows back over it */
+        if(now - curr->idle_since < decay_ms)
+            continue;
+
+        count = curr->count;
+        high  = curr->dirty > count ? (size_t)curr->dirty : count;
+        granularity = (curr->flags & ARENA_REGION_THP) ? ARENA_HUGE_PAGE_SIZE : (size_t)ARENA_PAGE_SIZE;
+        start = (count + granularity - 1) & ~(granularity - 1);
+        end   = arena__align__size(high);
+        if(end > curr->committed)
+            end = curr->committed;
+        if(start >= end)
+            continue;
+
+#ifdef ARENA_ATOMIC
+        /* The cursor, or a region a thread loaded before the cursor moved on, may be bumped
+           without the mutex. Filling the region sends those bumps to the slow path, which
+           waits for the mutex until the purge is done */
+        if(!atomic_compare_exchange_strong_explicit(&curr->count, &count, curr->committed,
+                                                    memory_order_acquire, memory_order_relaxed))
+            continue;
+#endif /*ARENA_ATOMIC*/
+        ret = madvise(curr->bytes + start, end - start, MADV_DONTNEED);
+        assert(ret == 0);
+        curr->dirty = start;
+#ifdef ARENA_ATOMIC
+        atomic_store_explicit(&curr->count, count, memory_order_release);
+#endif /*ARENA_ATOMIC*/
+        purged += end - start;
+    }
+
+    ret = pthread_mutex_unlock(&arena->mutex);
+    assert(ret == 0);
+    return purged;
+}
+
+void*
+arena__purge__thread(void *unused)
+{
+    struct timespec deadline;
+    Arena *arena;
+    uint64_t now;
+    int ret;
+
+    (void)unused;
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    while(arena__purge__running){
+        /* pthread_cond_timedwait measures the deadline against CLOCK_REALTIME */
+        ret = clock_gettime(CLOCK_REALTIME, &deadline);
+        assert(ret == 0);
+        deadline.tv_sec  += arena__purge__interval_ms / 1000;
+        deadline.tv_nsec += (long)(arena__purge__interval_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        ret = pthread_cond_timedwait(&arena__purge__cond, &arena__registry__mutex, &deadline);
+        if(!arena__purge__running)
+            break;
+
+        now = arena__now__ms();
+        for(arena = arena__registry; arena != NULL; arena = arena->registry_next)
+            arena__purge(arena, now, arena__purge__decay_ms);
+    }
+
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
+    assert(ret == 0);
+    return NULL;
+}
+
+/* Must be called after arena_init and before the arena is shared between threads */
+void
+arena_register(Arena *arena)
+{
+    int ret;
+
+    assert(arena != NULL);
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    if(!arena->registered){
+        arena->registry_prev = NULL;
+        arena->registry_next = arena__registry;
+        if(arena__registry != NULL)
+            arena__registry->registry_prev = arena;
+        arena__registry = arena;
+        arena->registered = 1;
+    }
+
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
+    assert(ret == 0);
+}
+
+void
+arena_unregister(Arena *arena)
+{
+    int ret;
+
+    assert(arena != NULL);
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    if(arena->registered){
+        if(arena->registry_prev != NULL)
+            arena->registry_prev->registry_next = arena->registry_next;
+        else
+            arena__registry = arena->registry_next;
+        if(arena->registry_next != NULL)
+            arena->registry_next->registry_prev = arena->registry_prev;
+        arena->registry_next = NULL;
+        arena->registry_prev = NULL;
+        arena->registered = 0;
+    }
+
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
     assert(ret == 0);
 }
 
+size_t
+arena_purge_all(void)
+{
+    Arena *arena;
+    uint64_t now;
+    size_t purged = 0;
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    now = arena__now__ms();
+    for(arena = arena__registry; arena != NULL; arena = arena->registry_next)
+        purged += arena__purge(arena, now, 0);
+
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
+    assert(ret == 0);
+    return purged;
+}
+
+/* Calling it again while the thread runs only changes its settings */
+void
+arena_purge_start(unsigned interval_ms, unsigned decay_ms)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    arena__purge__interval_ms = interval_ms != 0 ? interval_ms : ARENA_PURGE_INTERVAL_MS;
+    arena__purge__decay_ms    = decay_ms != 0 ? decay_ms : ARENA_PURGE_DECAY_MS;
+    if(!arena__purge__running){
+        arena__purge__running = 1;
+        ret = pthread_create(&arena__purge__tid, NULL, arena__purge__thread, NULL);
+        assert(ret == 0);
+    } else{
+        ret = pthread_cond_signal(&arena__purge__cond);
+        assert(ret == 0);
+    }
+
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
+    assert(ret == 0);
+}
+
+void
+arena_purge_stop(void)
+{
+    int running, ret;
+
+    ret = pthread_mutex_lock(&arena__registry__mutex);
+    assert(ret == 0);
+    running = arena__purge__running;
+    arena__purge__running = 0;
+    ret = pthread_cond_signal(&arena__purge__cond);
+    assert(ret == 0);
+    ret = pthread_mutex_unlock(&arena__registry__mutex);
+    assert(ret == 0);
+
+    if(running){
+        ret = pthread_join(arena__purge__tid, NULL);
+        assert(ret == 0);
+    }
+}
+
 #endif /*ARENA_ALLOCATOR_IMPLEMENTATION*/
 
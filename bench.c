@@ -0,0 +1,262 @@
+/*
+Benchmarks for the arena allocator, build with:
+    cc -O2 -pthread bench.c -o bench
+*/
+#define ARENA_ALLOCATOR_IMPLEMENTATION
+#include "arena_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SMALL_ALLOCATIONS 1000000
+#define BENCH_ARENA_CYCLES 2000
+#define BENCH_COPY_BYTES (64 << 20)
+#define BENCH_BATCH_NODES 10000
+#define BENCH_BATCH_ROUNDS 100
+#define BENCH_ZERO_BYTES (256 << 20)
+#define BENCH_RING_MESSAGES 1000000
+#define BENCH_RING_IN_FLIGHT 32
+
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Cost of a small allocation once the arena already holds `regions` full regions */
+double bench_region_count(size_t regions)
+{
+    Arena arena = {0};
+    size_t region_bytes = ARENA_REGION_DEFAULT_CAPACITY;
+    double start, end;
+
+    arena_init(&arena, ARENA_REGION_DEFAULT_CAPACITY);
+    for (size_t i = 0; i < regions; i++)
+        arena_alloc(&arena, region_bytes);
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_SMALL_ALLOCATIONS; i++) {
+        int *n = (int*) arena_alloc(&arena, 4 * sizeof(int));
+        n[0] = i;
+    }
+    end = now_ns();
+
+    arena_destroy(&arena);
+    return (end - start) / BENCH_SMALL_ALLOCATIONS;
+}
+
+/* arena_init -> work -> arena_destroy, as done once per request */
+double bench_arena_cycles(size_t cache_limit)
+{
+    double start, end;
+
+    arena_cache_set_limit(cache_limit);
+    start = now_ns();
+    for (int i = 0; i < BENCH_ARENA_CYCLES; i++) {
+        Arena arena = {0};
+        arena_init(&arena, ARENA_REGION_DEFAULT_CAPACITY);
+        for (int j = 0; j < 64; j++) {
+            char *buf = (char*) arena_alloc(&arena, 1024);
+            buf[0] = (char) j;
+        }
+        arena_destroy(&arena);
+    }
+    end = now_ns();
+    arena_cache_set_limit(0);
+
+    return (end - start) / BENCH_ARENA_CYCLES;
+}
+
+/* ns per node for BENCH_BATCH_NODES 32-byte nodes, one arena_alloc each or one arena_alloc_n */
+double bench_batch(int batched)
+{
+    static void *nodes[BENCH_BATCH_NODES];
+    Arena arena = {0};
+    double start, end;
+
+    arena_init(&arena, BENCH_BATCH_NODES * 32);
+    start = now_ns();
+    for (int r = 0; r < BENCH_BATCH_ROUNDS; r++) {
+        if (batched) {
+            arena_alloc_n(&arena, 32, BENCH_BATCH_NODES, nodes);
+        } else {
+            for (int i = 0; i < BENCH_BATCH_NODES; i++)
+                nodes[i] = arena_alloc(&arena, 32);
+        }
+        arena_reset(&arena);
+    }
+    end = now_ns();
+
+    arena_destroy(&arena);
+    return (end - start) / ((double) BENCH_BATCH_NODES * BENCH_BATCH_ROUNDS);
+}
+
+/* The byte loop arena_memcpy used to be, kept as the baseline */
+void *byte_memcpy(void *dest, const void *src, size_t n)
+{
+    volatile unsigned char *d = dest;
+    const unsigned char *s = src;
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+/* GB/s of copying `size` bytes at a time until BENCH_COPY_BYTES are moved */
+double bench_memcpy(void *(*copy)(void*, const void*, size_t), size_t size)
+{
+    Arena arena = {0};
+    unsigned char *src, *dest;
+    size_t rounds = BENCH_COPY_BYTES / size;
+    double start, end;
+
+    arena_init(&arena, 2 * size);
+    src  = (unsigned char*) arena_alloc(&arena, size);
+    dest = (unsigned char*) arena_alloc(&arena, size);
+    for (size_t i = 0; i < size; i++)
+        src[i] = (unsigned char) i;
+
+    start = now_ns();
+    for (size_t i = 0; i < rounds; i++)
+        copy(dest, src, size);
+    end = now_ns();
+
+    arena_destroy(&arena);
+    return (double) BENCH_COPY_BYTES / (end - start);
+}
+
+/* GB/s of arena_strlen over a string of `size` bytes */
+double bench_strlen(size_t size)
+{
+    Arena arena = {0};
+    char *str;
+    size_t rounds = BENCH_COPY_BYTES / size, total = 0;
+    double start, end;
+
+    arena_init(&arena, size + 1);
+    str = (char*) arena_alloc(&arena, size + 1);
+    for (size_t i = 0; i < size; i++)
+        str[i] = 'a' + (char) (i % 26);
+    str[size] = '\0';
+
+    start = now_ns();
+    for (size_t i = 0; i < rounds; i++)
+        total += arena_strlen(str);
+    end = now_ns();
+
+    arena_destroy(&arena);
+    return total == rounds * size ? (double) BENCH_COPY_BYTES / (end - start) : 0;
+}
+
+/* A table cleared with memset, the arena_alloc_zeroed baseline */
+void *memset_zeroed(Arena *arena, size_t size)
+{
+    unsigned char *ptr = arena_alloc(arena, size);
+    for (size_t i = 0; i < size; i++)
+        ptr[i] = 0;
+    return ptr;
+}
+
+/*
+    us per zeroed table of `size` bytes with one write every 16 pages, like a sparse hash table.
+    With `fresh` every round gets a new arena, otherwise the arena is reset between rounds so the
+    table lands on pages the previous round wrote. The dirty rows show where memset stops
+    beating MADV_DONTNEED, which is what ARENA_ZERO_DONTNEED_THRESHOLD should be set to.
+*/
+double bench_zeroed(void *(*zeroed)(Arena*, size_t), size_t size, int fresh)
+{
+    Arena arena = {0};
+    size_t rounds = BENCH_ZERO_BYTES / size;
+    double start, end;
+
+    if (rounds < 4)
+        rounds = 4;
+    if (!fresh)
+        arena_init(&arena, size);
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        if (fresh)
+            arena_init(&arena, size);
+        unsigned char *table = zeroed(&arena, size);
+        for (size_t i = 0; i < size; i += 16 * ARENA_PAGE_SIZE)
+            table[i] = 1;
+        if (fresh)
+            arena_destroy(&arena);
+        else
+            arena_reset(&arena);
+    }
+    end = now_ns();
+
+    if (!fresh)
+        arena_destroy(&arena);
+    return (end - start) / rounds / 1e3;
+}
+
+/* ns per message of 64 bytes to 4 KB, released in arrival order with BENCH_RING_IN_FLIGHT in flight */
+double bench_ring(int use_ring)
+{
+    static void *in_flight[BENCH_RING_IN_FLIGHT];
+    ArenaRing ring;
+    double start, end;
+
+    arena_ring_init(&ring, 1 << 20);
+    start = now_ns();
+    for (int i = 0; i < BENCH_RING_MESSAGES; i++) {
+        size_t size = 64 + (size_t) (i * 2654435761u) % 4032;
+        void **slot = &in_flight[i % BENCH_RING_IN_FLIGHT];
+        if (*slot != NULL) {
+            if (use_ring)
+                arena_ring_release(&ring, *slot);
+            else
+                free(*slot);
+        }
+        *slot = use_ring ? arena_ring_alloc(&ring, size) : malloc(size);
+        ((char*) *slot)[0] = (char) i;
+    }
+    end = now_ns();
+
+    for (int i = 0; i < BENCH_RING_IN_FLIGHT; i++) {
+        if (!use_ring)
+            free(in_flight[i]);
+        in_flight[i] = NULL;
+    }
+    arena_ring_destroy(&ring);
+    return (end - start) / BENCH_RING_MESSAGES;
+}
+
+int main()
+{
+    size_t regions[] = {1, 10, 100, 1000, 10000};
+
+    printf("== arena_alloc cost vs. region count ==\n");
+    for (size_t i = 0; i < ARENA_SIZE_ARR(regions); i++)
+        printf("%6zu regions: %6.2f ns/alloc\n", regions[i], bench_region_count(regions[i]));
+
+    printf("\n== arena_init/arena_destroy cycle ==\n");
+    printf("no region cache:    %8.0f ns/cycle\n", bench_arena_cycles(0));
+    printf("32 MB region cache: %8.0f ns/cycle\n", bench_arena_cycles(32 << 20));
+
+    printf("\n== %d nodes of 32 bytes ==\n", BENCH_BATCH_NODES);
+    printf("arena_alloc each: %6.2f ns/node\n", bench_batch(0));
+    printf("arena_alloc_n:    %6.2f ns/node\n", bench_batch(1));
+
+    printf("\n== arena_memcpy / arena_strlen throughput ==\n");
+    printf("byte loop,    64 KB: %6.2f GB/s\n", bench_memcpy(byte_memcpy, 64 << 10));
+    printf("arena_memcpy, 64 KB: %6.2f GB/s\n", bench_memcpy(arena_memcpy, 64 << 10));
+    printf("byte loop,    16 MB: %6.2f GB/s\n", bench_memcpy(byte_memcpy, 16 << 20));
+    printf("arena_memcpy, 16 MB: %6.2f GB/s\n", bench_memcpy(arena_memcpy, 16 << 20));
+    printf("arena_strlen,  1 MB: %6.2f GB/s\n", bench_strlen(1 << 20));
+
+    printf("\n== zeroed tables, us/table ==\n");
+    printf("%8s %14s %14s %14s %14s\n", "size", "fresh memset", "fresh zeroed", "dirty memset", "dirty zeroed");
+    for (size_t size = 256 << 10; size <= (64 << 20); size *= 4)
+        printf("%5zu KB %14.1f %14.1f %14.1f %14.1f\n", size >> 10,
+               bench_zeroed(memset_zeroed, size, 1), bench_zeroed(arena_alloc_zeroed, size, 1),
+               bench_zeroed(memset_zeroed, size, 0), bench_zeroed(arena_alloc_zeroed, size, 0));
+
+    printf("\n== FIFO messages, %d in flight ==\n", BENCH_RING_IN_FLIGHT);
+    printf("malloc/free:                    %6.2f ns/message\n", bench_ring(0));
+    printf("arena_ring_alloc/release:       %6.2f ns/message\n", bench_ring(1));
+
+    return 0;
+}
@@ -1,8 +1,11 @@
 #define ARENA_ALLOCATOR_IMPLEMENTATION
 #include "arena_allocator.h"
 #include <stdio.h>
+#include <time.h>
 
 #define NO_ELEMENTS 10
+#define BENCH_THREADS 8
+#define BENCH_ALLOCATIONS 20000
 
 typedef struct {
     Arena *arena;
@@ -43,6 +46,37 @@ void* alloc_numbers2(void * ptr)
     return  NULL;
 }
 
+void* bench_worker(void * ptr)
+{
+    Arena *arena = (Arena*) ptr;
+    for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+        int *n = (int*) arena_alloc(arena, 4 * sizeof(int));
+        n[0] = i;
+    }
+    return NULL;
+}
+
+double bench_threads(int thread_cache)
+{
+    Arena arena = {0};
+    pthread_t threads[BENCH_THREADS];
+    struct timespec start, end;
+
+    arena_init(&arena, ARENA_REGION_DEFAULT_CAPACITY);
+    if (thread_cache)
+        arena_thread_cache_enable(&arena, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_THREADS; i++)
+        pthread_create(&threads[i], NULL, bench_worker, (void *) &arena);
+    for (int i = 0; i < BENCH_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    arena_destroy(&arena);
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
 int main() 
 {
     // Initialize the arena
@@ -77,5 +111,10 @@ int main()
 
     // Deallocate the arena all at once
     arena_reset(&arena);
+
+    // Compare the shared mutex with per-thread caches
+    printf("%d threads x %d allocations\n", BENCH_THREADS, BENCH_ALLOCATIONS);
+    printf("shared arena:  %.2f ms\n", bench_threads(0));
+    printf("thread caches: %.2f ms\n", bench_threads(1));
     return 0;
 }